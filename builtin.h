@@ -0,0 +1,79 @@
+/*
+ * Builtin interface of smallsh.
+ * -----------------------------------------------------------------------------
+ * Builtins inside smallsh and builtins loaded from a shared object with
+ *   enable -f lib.so NAME
+ * share this interface. A shared object providing the builtin NAME exports:
+ *
+ *   #include "builtin.h"
+ *
+ *   const int smallsh_builtin_abi = SMALLSH_BUILTIN_ABI;
+ *
+ *   static int run_hello(char **arguments, struct builtin_context *context) {
+ *     dprintf(context->output_fd, "hello %s\n", arguments[1]);
+ *     return 0;
+ *   }
+ *
+ *   const struct builtin hello_builtin = {"hello", run_hello, 0};
+ *
+ * and is built with "gcc -shared -fPIC -o hello.so hello.c".
+ * The builtin writes to output_fd and reads from input_fd instead of
+ *   stdout and stdin, which are only redirected for forked builtins.
+ *   Diagnostics go to stderr.
+ */
+#ifndef SMALLSH_BUILTIN_H
+#define SMALLSH_BUILTIN_H
+
+#include <stdbool.h>
+
+/* Version of this interface, bumped on any incompatible change */
+#define SMALLSH_BUILTIN_ABI 1
+
+#define BUILTIN_FORKED 1
+#define BUILTIN_THREAD_SAFE 2
+
+/* Struct: builtin_context
+ * -----------------------------------------------------------------------------
+ * Everything a builtin may use besides its arguments.
+ *   directory_fd - directory relative paths are resolved against,
+ *                  AT_FDCWD unless the builtin runs on the thread pool
+ *   input_fd - file descriptor to read input from
+ *   output_fd - file descriptor to write output to
+ *   cancelled - set when the builtin should stop as soon as possible,
+ *               NULL when the builtin runs in a child process, which
+ *               SIGINT stops by itself
+ *   environment - the environment of the shell, NULL terminated
+ *   get_variable - returns the value of a shell or environment variable,
+ *                  NULL if it is not set
+ *   set_variable - sets a shell variable
+ *                  Both are NULL when the builtin runs on the thread pool,
+ *                  and only affect the child when it runs in one.
+ */
+struct builtin_context {
+  int directory_fd;
+  int input_fd;
+  int output_fd;
+  volatile bool *cancelled;
+  char **environment;
+  const char *(*get_variable)(const char *name);
+  void (*set_variable)(const char *name, const char *value);
+};
+
+/* Struct: builtin
+ * -----------------------------------------------------------------------------
+ * A builtin that is run through the builtin_context interface.
+ *   name - the command name of the builtin
+ *   run - runs the builtin, returning its exit value
+ *   flags - BUILTIN_FORKED if it always runs in a forked child process
+ *           after redirection, BUILTIN_THREAD_SAFE if background invocations
+ *           may run on the thread pool instead of a forked child.
+ *           Builtins without flags run in the shell process in the
+ *           foreground and in a forked child in the background.
+ */
+struct builtin {
+  char *name;
+  int (*run)(char **arguments, struct builtin_context *context);
+  int flags;
+};
+
+#endif
@@ -1,5 +1,7 @@
 /* Libraries */
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
@@ -10,6 +12,28 @@
 #include <limits.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <ctype.h>
+#include <time.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <dlfcn.h>
+#include <regex.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+#include "builtin.h"
 
 /* Constants */
 #define MAX_COMMAND_LENGTH 2048
@@ -18,6 +42,36 @@
 #define FAILURE 1
 #define INPUT 0
 #define OUTPUT 1
+#define READ_CHUNK_SIZE 512
+#define MAX_SHARD_WORKERS 256
+#define MAX_PFOR_AHEAD 64
+#define SHARD_BATCH_SIZE 65536
+#define WORK_QUEUE_SLOTS 64
+#define WORK_QUEUE_MAGIC 0x736d7368
+#define SEMAPHORE_MAGIC 0x736d7370
+#define SHM_DIRECTORY "/dev/shm"
+#define MAX_POOL_THREADS 8
+#define MAX_OUTPUT_FILES 16
+#define MAX_VARIABLE_NAME 64
+#define MAX_MESSAGE_LENGTH 256
+#define MAX_LISTED_NOTIFICATIONS 16
+#define PATH_CACHE_SIZE 128
+#define LOOKAHEAD_LINES 8
+#define MAX_PARALLEL_COMMANDS 16
+#define ONCE_HEADER_LENGTH 16
+#define TRAP_EXIT 0
+#define TRAP_ERR NSIG
+#define URING_READ_INPUT 0
+#define URING_WRITE_WORKER 1
+#define URING_READ_WORKER 2
+#define MAX_LOADED_BUILTINS 64
+#define JSON_CACHE_SIZE 8
+#define REGEX_CACHE_SIZE 32
+#define COPY_BUFFER_SIZE 65536
+#define MAX_REGEX_GROUPS 32
+#define FIELDS_BUFFER_SIZE 65536
+#define WALK_BUFFER_SIZE 32768
+#define MAX_WALK_THREADS 16
 
 /* Structs */
 /* Struct: command
@@ -27,6 +81,10 @@
  *               except for input/output redirection and background process.
  *   input_file - filename of input file for input redirection
  *   output_file - filename of output file for output redirection
+ *   extra_output_files - filenames of further output files, NULL terminated,
+ *                        which receive a copy of the output (multios)
+ *   input_descriptor - descriptor to duplicate as input (<&N), -1 if none
+ *   output_descriptor - descriptor to duplicate as output (>&N), -1 if none
  *   background - if the process should be in the background
  *                  true for background process
  *                  false for foreground process
@@ -35,20 +93,632 @@ struct command {
   char *arguments[MAX_ARGS];
   char *input_file;
   char *output_file;
+  char *extra_output_files[MAX_OUTPUT_FILES];
+  int input_descriptor;
+  int output_descriptor;
   bool background;
 };
 
+/* Struct: parser
+ * -----------------------------------------------------------------------------
+ * Incremental parser state over the raw input stream.
+ * Bytes are read in arbitrary chunks and complete lines are handed out as soon
+ *   as their newline arrives, so only the unfinished suffix is kept around.
+ *   buffer - bytes read from the input but not consumed as a command yet
+ *   start - offset of the first unconsumed byte in buffer
+ *   end - offset one past the last byte read into buffer
+ *   discarding - if the current line is longer than MAX_COMMAND_LENGTH and
+ *                the rest of it should be dropped until the next newline
+ *   end_of_input - if the input stream has been closed
+ *   line_number - number of input lines consumed so far
+ */
+struct parser {
+  char buffer[MAX_COMMAND_LENGTH + 1];
+  size_t start;
+  size_t end;
+  bool discarding;
+  bool end_of_input;
+  int line_number;
+};
+
+/* Struct: byte_buffer
+ * -----------------------------------------------------------------------------
+ * Growable buffer of bytes.
+ *   data - points to the bytes, NULL until something is appended
+ *   length - number of bytes in use
+ *   capacity - number of bytes allocated
+ */
+struct byte_buffer {
+  char *data;
+  size_t length;
+  size_t capacity;
+};
+
+/* Struct: shard_worker
+ * -----------------------------------------------------------------------------
+ * A single worker process started by the shard builtin.
+ *   process_id - the id of the worker process
+ *   input_fd - write end of the pipe to the worker's stdin, -1 once closed
+ *   output_fd - read end of the pipe from the worker's stdout, -1 once closed
+ *   pending - lines queued for the worker that have not been written yet
+ *   in_flight - lines handed to an io_uring write that has not completed
+ *   merged - output read from the worker that is not a complete line yet
+ *   input_index - index of input_fd in the poll array, -1 if not polled
+ *   output_index - index of output_fd in the poll array, -1 if not polled
+ *   input_busy - if an io_uring write to the worker is in flight
+ *   output_busy - if an io_uring read from the worker is in flight
+ */
+struct shard_worker {
+  pid_t process_id;
+  int input_fd;
+  int output_fd;
+  struct byte_buffer pending;
+  struct byte_buffer in_flight;
+  struct byte_buffer merged;
+  int input_index;
+  int output_index;
+  bool input_busy;
+  bool output_busy;
+};
+
+/* Struct: shard_state
+ * -----------------------------------------------------------------------------
+ * State of the shard builtin shared by its relay backends.
+ *   workers - the worker processes
+ *   num_workers - number of worker processes
+ *   key_field - 1-based field hashed to pick a worker, 0 for round-robin
+ *   unfinished_line - input read from stdin that is not a complete line yet
+ *   input_done - if stdin has been exhausted
+ *   next_worker - worker receiving the current round-robin batch
+ *   batch_length - number of bytes in the current round-robin batch
+ *   open_outputs - number of workers whose stdout has not been closed yet
+ *   ordered - if output is merged in input order (-k)
+ *   order - in ordered mode, the shard_batch records of the lines given to
+ *           the workers, in input order
+ *   order_start - offset of the first record not written out yet
+ */
+struct shard_state {
+  struct shard_worker *workers;
+  int num_workers;
+  int key_field;
+  struct byte_buffer unfinished_line;
+  bool input_done;
+  int next_worker;
+  size_t batch_length;
+  int open_outputs;
+  bool ordered;
+  struct byte_buffer order;
+  size_t order_start;
+};
+
+/* Struct: shard_batch
+ * -----------------------------------------------------------------------------
+ * Consecutive input lines given to the same shard worker, in ordered mode.
+ *   worker - index of the worker
+ *   num_lines - number of lines whose output has not been written yet
+ */
+struct shard_batch {
+  int worker;
+  size_t num_lines;
+};
+
+#ifdef HAVE_IO_URING
+/* Struct: uring
+ * -----------------------------------------------------------------------------
+ * An io_uring instance driven through raw system calls.
+ *   file_descriptor - the io_uring file descriptor
+ *   ring_memory - mapping of the submission and completion rings
+ *   ring_size - size of ring_memory
+ *   sqes - the submission queue entries
+ *   sqes_size - size of sqes
+ *   sq_tail, sq_mask, sq_array - submission ring fields
+ *   cq_head, cq_tail, cq_mask, cqes - completion ring fields
+ *   to_submit - number of entries queued since the last io_uring_enter
+ */
+struct uring {
+  int file_descriptor;
+  void *ring_memory;
+  size_t ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned to_submit;
+};
+#endif
+
+/* Struct: pfor_iteration
+ * -----------------------------------------------------------------------------
+ * A single iteration of the pfor builtin.
+ *   process_id - the id of the process running the iteration
+ *   output_fd - memory file holding stdout of the iteration in ordered mode,
+ *               -1 otherwise or once it has been written out
+ *   finished - if the iteration process has been reaped
+ */
+struct pfor_iteration {
+  pid_t process_id;
+  int output_fd;
+  bool finished;
+};
+
+/* Struct: shared_semaphore
+ * -----------------------------------------------------------------------------
+ * Named counting semaphore of the sem builtin, in a shared memory segment.
+ *   magic - SEMAPHORE_MAGIC, set before the segment is published
+ *   permits - the number of permits it was created with
+ *   semaphore - the process-shared semaphore, blocking on a futex
+ */
+struct shared_semaphore {
+  unsigned int magic;
+  int permits;
+  sem_t semaphore;
+};
+
+/* Struct: work_entry
+ * -----------------------------------------------------------------------------
+ * A command line queued in the host-local work queue.
+ *   directory - working directory of the submitting shell
+ *   command - the command line, with variables already expanded
+ */
+struct work_entry {
+  char directory[PATH_MAX];
+  char command[MAX_COMMAND_LENGTH];
+};
+
+/* Struct: work_queue
+ * -----------------------------------------------------------------------------
+ * Host-local queue of command lines in a named shared memory segment,
+ *   shared by every smallsh instance of the same user.
+ * The process-shared semaphores and mutex block in the kernel through futexes.
+ *   magic - WORK_QUEUE_MAGIC, set before the segment is published
+ *   lock - robust mutex guarding head, tail and the entries, released by
+ *          the kernel if its owner dies
+ *   items - number of queued command lines
+ *   slots - number of free entries
+ *   head - number of command lines taken out of the queue
+ *   tail - number of command lines put into the queue
+ *   entries - ring of command lines, indexed modulo WORK_QUEUE_SLOTS
+ */
+struct work_queue {
+  unsigned int magic;
+  pthread_mutex_t lock;
+  sem_t items;
+  sem_t slots;
+  unsigned int head;
+  unsigned int tail;
+  struct work_entry entries[WORK_QUEUE_SLOTS];
+};
+
+/* Struct: thread_job
+ * -----------------------------------------------------------------------------
+ * A background builtin queued on or running on the thread pool.
+ *   job_id - the id of the pseudo-job, reported like a process id
+ *   builtin - the builtin to run
+ *   arguments - a private copy of the arguments of the builtin
+ *   context - the context the builtin runs with, owning its descriptors
+ *   cancelled - set by the shell to ask the builtin to stop
+ *   finished - set by the pool thread once the builtin has returned
+ *   exit_value - the exit value of the builtin once finished
+ *   next - next job in the pool queue
+ */
+struct thread_job {
+  int job_id;
+  const struct builtin *builtin;
+  char **arguments;
+  struct builtin_context context;
+  volatile bool cancelled;
+  bool finished;
+  int exit_value;
+  struct thread_job *next;
+};
+
+/* Struct: thread_pool
+ * -----------------------------------------------------------------------------
+ * Worker threads running background builtins, started on first use.
+ *   lock - guards the queue
+ *   available - signalled when a job is queued
+ *   head - first queued job, NULL if the queue is empty
+ *   tail - last queued job
+ *   num_threads - number of started worker threads
+ *   threads - the worker threads
+ */
+struct thread_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t available;
+  struct thread_job *head;
+  struct thread_job *tail;
+  int num_threads;
+  pthread_t threads[MAX_POOL_THREADS];
+};
+
+/* Struct: linux_dirent64
+ * -----------------------------------------------------------------------------
+ * Directory entry as returned by the getdents64 system call.
+ */
+struct linux_dirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/* Struct: walk_filter
+ * -----------------------------------------------------------------------------
+ * Conditions a path must meet to be selected by the walk builtin.
+ *   name - wildcard pattern the file name must match, NULL for any name
+ *   type - 'f', 'd' or 'l' for a regular file, directory or symbolic link,
+ *          '\0' for any type
+ *   size_comparison, size - '+', '-' or '=' for a size larger than, smaller
+ *                           than or equal to size bytes, '\0' for any size
+ *   age_comparison, age - the same for the age in days since modification
+ *   now - the time ages are measured from
+ */
+struct walk_filter {
+  char *name;
+  char type;
+  char size_comparison;
+  long long size;
+  char age_comparison;
+  long long age;
+  time_t now;
+};
+
+/* Struct: walk_state
+ * -----------------------------------------------------------------------------
+ * State shared by the threads of the walk builtin.
+ *   lock - guards everything below but the filter and output_fd
+ *   changed - signalled when a directory or a batch is queued,
+ *             or the walk is finished
+ *   directories - stack of directories still to be read
+ *   num_directories, directories_capacity - entries in use and allocated
+ *   num_busy - number of threads reading a directory
+ *   finished - if every directory has been read
+ *   filter - the conditions on selected paths
+ *   directory_fd - directory relative paths are resolved against
+ *   output_fd - where selected paths are printed without a command
+ *   batch - selected paths not yet given to the command, NULL terminated
+ *   num_batch_paths, batch_length - number and argument bytes of the paths
+ *   batch_limit - argument bytes a batch may take
+ *   ready - full batches waiting for the command, oldest first
+ *   num_ready - number of full batches
+ *   exit_value - FAILURE if a directory could not be read
+ *   output_lock - keeps blocks of printed paths whole
+ */
+struct walk_state {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  char **directories;
+  int num_directories;
+  int directories_capacity;
+  int num_busy;
+  bool finished;
+  struct walk_filter filter;
+  int directory_fd;
+  int output_fd;
+  char **batch;
+  int num_batch_paths;
+  size_t batch_length;
+  size_t batch_limit;
+  char ***ready;
+  int num_ready;
+  int exit_value;
+  pthread_mutex_t output_lock;
+};
+
+/* Struct: top_process
+ * -----------------------------------------------------------------------------
+ * A process watched by jobs --top, with its /proc files kept open.
+ *   process_id - the id of the process
+ *   job_index - index of the background job the process belongs to
+ *   stat_fd, statm_fd, io_fd, children_fd - open /proc files of the process
+ *   alive - if the process has been seen in the current refresh
+ *   first_sample - if the process has not been sampled yet
+ *   ticks, previous_ticks - CPU time in clock ticks, now and one refresh ago
+ *   resident_bytes - resident memory
+ *   read_bytes, previous_read - bytes read, now and one refresh ago
+ *   written_bytes, previous_written - bytes written, now and one refresh ago
+ */
+struct top_process {
+  pid_t process_id;
+  int job_index;
+  int stat_fd;
+  int statm_fd;
+  int io_fd;
+  int children_fd;
+  bool alive;
+  bool first_sample;
+  unsigned long long ticks;
+  unsigned long long previous_ticks;
+  unsigned long resident_bytes;
+  unsigned long long read_bytes;
+  unsigned long long previous_read;
+  unsigned long long written_bytes;
+  unsigned long long previous_written;
+};
+
+/* Struct: top_state
+ * -----------------------------------------------------------------------------
+ * Processes watched by jobs --top.
+ *   processes - the watched processes
+ *   num_processes - number of watched processes
+ *   capacity - number of allocated entries in processes
+ *   page_size - size of a memory page, for converting statm
+ */
+struct top_state {
+  struct top_process *processes;
+  int num_processes;
+  int capacity;
+  long page_size;
+};
+
+/* Struct: variable
+ * -----------------------------------------------------------------------------
+ * Single node of a linked list that represents a shell variable.
+ *   name - the name of the variable
+ *   values - the values of the variable, one for a plain variable
+ *   num_values - number of values
+ *   next - point to the next variable
+ */
+struct variable {
+  char *name;
+  char **values;
+  int num_values;
+  struct variable *next;
+};
+
+/* Struct: json_node
+ * -----------------------------------------------------------------------------
+ * Single value of a parsed JSON document. The values are stored in document
+ *   order, so the members of an object or array follow it directly.
+ *   type - '{', '[', '"' or 'n' for an object, array, string or number, and
+ *          't', 'f' or 'l' for true, false and null
+ *   start, end - byte range of the value in the document
+ *   next - index of the first node after the value and its members
+ */
+struct json_node {
+  char type;
+  size_t start;
+  size_t end;
+  int next;
+};
+
+/* Struct: json_document
+ * -----------------------------------------------------------------------------
+ * Single node of a linked list of mapped and parsed JSON files, most recently
+ *   used first, reused while the file is not modified.
+ *   device, inode, modified, size - identity of the file when it was parsed
+ *   data - the mapped file
+ *   nodes - the parsed values, nodes[0] is the root
+ *   num_nodes - number of parsed values
+ *   next - point to the next document
+ */
+struct json_document {
+  dev_t device;
+  ino_t inode;
+  struct timespec modified;
+  off_t size;
+  char *data;
+  struct json_node *nodes;
+  int num_nodes;
+  struct json_document *next;
+};
+
+/* Struct: regex_entry
+ * -----------------------------------------------------------------------------
+ * Single node of a linked list of compiled regular expressions,
+ *   most recently used first.
+ *   pattern - the regular expression
+ *   flags - the flags it was compiled with
+ *   compiled - the compiled regular expression
+ *   next - point to the next entry
+ */
+struct regex_entry {
+  char *pattern;
+  int flags;
+  regex_t compiled;
+  struct regex_entry *next;
+};
+
+/* Struct: alias
+ * -----------------------------------------------------------------------------
+ * Single node of a linked list that represents an alias.
+ *   name - the name of the alias
+ *   tokens - the words the alias expands to, split when it is defined
+ *   num_tokens - number of words
+ *   generation - the last expansion that used the alias, to stop recursion
+ *   next - point to the next alias
+ */
+struct alias {
+  char *name;
+  char **tokens;
+  int num_tokens;
+  unsigned long generation;
+  struct alias *next;
+};
+
+/* Struct: shell_builtin
+ * -----------------------------------------------------------------------------
+ * A builtin that changes the state of the shell itself, so it always runs
+ *   in the shell process and gets the whole command.
+ *   name - the command name of the builtin
+ *   run - runs the builtin, setting the status in program_status
+ */
+struct shell_builtin {
+  char *name;
+  void (*run)(struct command *user_command);
+};
+
+/* Struct: registry_entry
+ * -----------------------------------------------------------------------------
+ * Slot of the builtin registry, a perfect hash table of every builtin name.
+ *   name - the command name, NULL for an empty slot
+ *   shell_builtin - the builtin if it is a shell builtin, else NULL
+ *   builtin - the builtin if it uses the builtin_context interface, else NULL
+ */
+struct registry_entry {
+  const char *name;
+  const struct shell_builtin *shell_builtin;
+  const struct builtin *builtin;
+};
+
+/* Struct: shadowed_utility
+ * -----------------------------------------------------------------------------
+ * A standard utility that a builtin stands in for, supporting only some of
+ *   its options.
+ *   run - runs the builtin
+ *   supported - returns whether the builtin handles the arguments,
+ *               otherwise the utility is executed instead
+ */
+struct shadowed_utility {
+  int (*run)(char **arguments, struct builtin_context *context);
+  bool (*supported)(char **arguments);
+};
+
+/* Struct: builtin_registry
+ * -----------------------------------------------------------------------------
+ * Perfect hash table of the builtins.
+ *   entries - the slots, no two names hash to the same slot
+ *   size - number of slots, a power of two
+ *   seed - the seed of hash_name that makes the hash perfect
+ *   loaded - the builtins loaded with enable -f
+ *   num_loaded - number of loaded builtins
+ */
+struct builtin_registry {
+  struct registry_entry *entries;
+  unsigned long size;
+  unsigned long seed;
+  const struct builtin *loaded[MAX_LOADED_BUILTINS];
+  int num_loaded;
+};
+
+/* Struct: signal_name
+ * -----------------------------------------------------------------------------
+ * Name of a condition that can be trapped.
+ *   name - the name without the SIG prefix
+ *   number - the signal number, or TRAP_EXIT or TRAP_ERR
+ */
+struct signal_name {
+  char *name;
+  int number;
+};
+
 /* Struct: process
  * -----------------------------------------------------------------------------
  * Single node of a linked list that represents a single process.
- *   process_id - the id of the process
+ *   process_id - the id of the process, or the negated job id of a
+ *                background builtin running on the thread pool
+ *   thread_job - the pool job of a background builtin, NULL for processes
+ *   holds_token - if the process was admitted with a jobserver token,
+ *                 which is returned when it is removed
  *   next - point to the next node of the process
  */
 struct process {
   pid_t process_id;
+  struct thread_job *thread_job;
+  bool holds_token;
   struct process *next;
 };
 
+/* Struct: path_entry
+ * -----------------------------------------------------------------------------
+ * Single node of a bucket of the PATH cache.
+ *   name - the command name
+ *   path - the executable the name resolved to through PATH
+ *   next - point to the next node of the bucket
+ */
+struct path_entry {
+  char *name;
+  char *path;
+  struct path_entry *next;
+};
+
+/* Struct: parallel_command
+ * -----------------------------------------------------------------------------
+ * A command of a block run concurrently by set -o autoparallel.
+ *   command - the parsed command
+ *   input - canonical path of its input file
+ *   output - canonical path of its output file, empty if it has none
+ *   process_id - its process
+ *   output_fd, error_fd - memory files capturing its stdout and stderr
+ */
+struct parallel_command {
+  struct command command;
+  char input[PATH_MAX];
+  char output[PATH_MAX];
+  pid_t process_id;
+  int output_fd;
+  int error_fd;
+};
+
+/* Struct: line_profile
+ * -----------------------------------------------------------------------------
+ * Cost of one line of a script profiled with --profile-lines, summed over
+ *   every time the line ran.
+ *   text - the source of the line
+ *   count - number of times the line ran
+ *   wall_time, shell_time, child_time - wall clock time, CPU time of the
+ *        shell and CPU time of the children reaped meanwhile, in seconds
+ *   num_forks - number of processes the shell forked for the line
+ */
+struct line_profile {
+  char *text;
+  long count;
+  double wall_time;
+  double shell_time;
+  double child_time;
+  long num_forks;
+};
+
+/* Struct: profile_sample
+ * -----------------------------------------------------------------------------
+ * Counters taken before a command runs, to charge the difference to its line.
+ */
+struct profile_sample {
+  struct timespec wall;
+  struct rusage shell;
+  struct rusage children;
+  long num_forks;
+};
+
+/* Struct: profiler
+ * -----------------------------------------------------------------------------
+ * State of the line profiler (--profile-lines).
+ *   enabled - if commands are being profiled
+ *   lines - the profile of each line, indexed by line number
+ *   num_lines - number of entries in lines
+ *   current_line - the line number of the command being run
+ */
+struct profiler {
+  bool enabled;
+  struct line_profile *lines;
+  int num_lines;
+  int current_line;
+};
+
+/* Struct: jobserver
+ * -----------------------------------------------------------------------------
+ * GNU make compatible jobserver shared by the shell and its children.
+ *   read_fd, write_fd - the token pipe, inherited by children and
+ *                       advertised in MAKEFLAGS, -1 if there is none
+ *   try_fd - a private non-blocking description of the read end, so the
+ *            shell never blocks on the pipe make reads from
+ *   size - number of tokens (set -o jobs=N)
+ *   saved_makeflags - MAKEFLAGS before the jobserver was started
+ */
+struct jobserver {
+  int read_fd;
+  int write_fd;
+  int try_fd;
+  int size;
+  char *saved_makeflags;
+};
+
 /* Struct: status
  * -----------------------------------------------------------------------------
  * Represents the current status of the program
@@ -63,6 +733,14 @@ struct process {
  *                finished or reaped yet.
  *   foreground_only - if processes should be run in the foreground only.
  *                     (fg-only mode)
+ *   pipe_size - capacity of pipes created by the shell, 0 for the default.
+ *               (set -o pipesize=BYTES)
+ *   notify - if finished background jobs are reported right away instead of
+ *            before the next prompt. (set -b)
+ *   autoparallel - if independent consecutive commands of a script may run
+ *                  concurrently. (set -o autoparallel)
+ *   nocasematch - if [[ ]] matches patterns and regular expressions
+ *                 ignoring case. (set -o nocasematch)
  */
 struct status {
   bool exit_program;
@@ -71,32 +749,295 @@ struct status {
   pid_t foreground;
   struct process *background;
   bool foreground_only;
+  int pipe_size;
+  bool notify;
+  bool autoparallel;
+  bool nocasematch;
 };
 
 /* Global Variable */
-struct status program_status = {false, SUCCESS, 0, 0, NULL, false};
+struct status program_status = {false, SUCCESS, 0, 0, NULL, false, 0, false,
+                                 false, false};
 struct sigaction sa_sigint = {{0}};
 struct sigaction sa_sigtstp = {{0}};
 struct sigaction sa_sigchld = {{0}};
+struct parser input_parser = {{0}, 0, 0, false, false, 0};
+struct work_queue *shared_queue = NULL;
+struct thread_pool builtin_pool = {PTHREAD_MUTEX_INITIALIZER,
+                                   PTHREAD_COND_INITIALIZER, NULL, NULL, 0};
+int next_job_id = 1;
+struct variable *shell_variables = NULL;
+struct json_document *json_documents = NULL;
+struct regex_entry *cached_regexes = NULL;
+struct byte_buffer pending_notifications = {NULL, 0, 0};
+struct byte_buffer done_notifications = {NULL, 0, 0};
+int num_pending_notifications = 0;
+struct jobserver jobserver = {-1, -1, -1, 0, NULL};
+struct path_entry *path_cache[PATH_CACHE_SIZE];
+char *cached_path_variable = NULL;
+bool script_mode = false;
+int script_fd = STDIN_FILENO;
+long num_forks = 0;
+struct profiler profiler = {false, NULL, 0, 0};
+struct alias *shell_aliases = NULL;
+unsigned long alias_generation = 0;
+struct builtin_registry builtin_registry = {NULL, 0, 0, {NULL}, 0};
+volatile sig_atomic_t pending_signals[NSIG];
+volatile sig_atomic_t signals_pending = 0;
+volatile pid_t semaphore_child = 0;
+volatile bool builtin_cancelled = false;
+bool pending_traps[NSIG];
+bool error_pending = false;
+bool mode_message_pending = false;
+bool running_trap = false;
+char *trap_commands[NSIG + 1];
+
+/* Conditions accepted by trap besides signal numbers */
+const struct signal_name signal_names[] = {
+  {"EXIT", TRAP_EXIT}, {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT},
+  {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM},
+  {"TERM", SIGTERM}, {"CHLD", SIGCHLD}, {"WINCH", SIGWINCH},
+  {"ERR", TRAP_ERR}, {NULL, 0}
+};
 
 /* Function Prototypes */
 int get_command(struct command *user_command);
+int parse_command(char *input_line, struct command *user_command);
+int fill_parser(struct parser *state, int file_descriptor);
+bool next_line_pending(struct parser *state);
+char *next_line(struct parser *state);
 void reset_command(struct command *user_command, bool reset_command);
 char *expand_variable(char *unexpanded_string);
+char *expand_word(char *unexpanded_string, const char *kept_name);
+struct variable *find_array_reference(const char *word);
+struct variable *find_variable(const char *name);
+void set_variable(const char *name, char **values, int num_values);
+bool assign_variable(struct command *user_command);
+void read_variables(struct command *user_command);
+int parse_json(struct json_document *document);
+void free_json_document(struct json_document *document);
+struct json_document *load_json(const char *path);
+bool json_key_equals(struct json_document *document, int key,
+                     const char *name, size_t length);
+int query_json(struct json_document *document, int node, const char *query,
+               int *results, int num_results);
+char *json_value(struct json_document *document, int node);
+void extract_json(struct command *user_command);
+regex_t *compile_regex(const char *pattern, int flags);
+int match_regex(const char *string, const char *pattern);
+void test_condition(struct command *user_command);
+void start_coprocess(struct command *user_command);
+struct alias *find_alias(const char *name);
+int expand_alias(char **tokens, int num_tokens);
+void print_alias(struct alias *alias);
+void define_alias(struct command *user_command);
+void remove_alias(struct command *user_command);
 void execute_command(struct command *user_command);
 void report_status(void);
 void change_directory(struct command *user_command);
 void exit_and_cleanup(struct command *user_command);
 void fork_and_execute(struct command *user_command);
+void run_child(struct command *user_command, const char *path);
 void handle_sigchld(int signal);
 void handle_sigtstp(int signal);
-void push_background_process(int process_id);
+void handle_trapped_signal(int signal);
+void handle_builtin_sigint(int signal);
+void handle_pending_signals(void);
+bool other_signals_pending(int signal);
+void reap_children(void);
+void wait_for_foreground(void);
+void run_trap(int condition);
+int parse_condition(char *name);
+void set_trap(struct command *user_command);
+void reset_trapped_signals(void);
+void clear_path_cache(void);
+bool search_path(const char *path_variable, const char *name, char *path);
+const char *resolve_command(const char *name);
+void hash_commands(struct command *user_command);
+void prefetch_upcoming_commands(void);
+bool canonical_path(const char *path, char *canonical);
+bool parallel_candidate(struct parallel_command *candidate);
+bool parallel_conflict(struct parallel_command *block, int num_commands);
+void emit_captured_output(int capture_fd, int file_descriptor);
+bool run_parallel_block(struct command *user_command);
+struct line_profile *profile_line(int line_number);
+void start_profile_sample(struct profile_sample *sample);
+void record_profile_sample(struct profile_sample *sample);
+int compare_line_profiles(const void *first, const void *second);
+void print_line_profile(void);
+bool start_jobserver(int size);
+void stop_jobserver(void);
+bool try_job_token(void);
+bool acquire_job_token(void);
+void release_job_token(void);
+struct process *push_background_process(int process_id,
+                                        struct thread_job *thread_job);
 bool pop_background_process(int process_id);
-void write_integer(int num);
+size_t format_integer(char *buffer, size_t size, long num);
+size_t format_message(char *message, size_t size, const char *format,
+                      va_list arguments);
+void write_message(int file_descriptor, const char *format, ...);
+void notify_completion(const char *format, ...);
+void flush_notifications(void);
 bool redirect(struct command *user_command, int mode);
+void append_buffer(struct byte_buffer *buffer, const char *data, size_t length);
+void consume_buffer(struct byte_buffer *buffer, size_t length);
+bool write_all(int file_descriptor, const char *data, size_t length);
+unsigned long hash_key_field(const char *line, size_t length, int field);
+bool start_shard_worker(struct shard_worker *worker, char **worker_command);
+void flush_merged_lines(struct shard_worker *worker, bool finished);
+void record_shard_line(struct shard_state *state, int worker);
+void flush_ordered_lines(struct shard_state *state);
+void stop_shard_workers(struct shard_state *state, int num_started);
+void distribute_input(struct shard_state *state, const char *data,
+                      size_t length);
+bool accepts_input(struct shard_state *state);
+void close_worker_input(struct shard_worker *worker);
+void collect_worker_output(struct shard_state *state,
+                           struct shard_worker *worker, const char *data,
+                           size_t length);
+void relay_with_poll(struct shard_state *state);
+#ifdef HAVE_IO_URING
+bool setup_uring(struct uring *ring, unsigned entries);
+void queue_uring_operation(struct uring *ring, int opcode, int file_descriptor,
+                           void *buffer, size_t length, unsigned long tag);
+bool wait_uring(struct uring *ring);
+bool relay_with_uring(struct shard_state *state);
+#endif
+int run_shard(char **arguments, struct builtin_context *context);
+bool strip_separator(char *token);
+char *substitute_loop_variable(char *argument, char *name, char *value);
+bool start_pfor_iteration(struct pfor_iteration *iteration, char **body,
+                          char *name, char *item, bool ordered);
+int flush_pfor_output(struct pfor_iteration *iterations, int num_items,
+                      int next_output);
+int run_pfor(char **arguments, struct builtin_context *context);
+int create_shared_segment(const char *name, size_t size,
+                          void (*initialize)(void *segment, int argument),
+                          int argument);
+void *map_shared_segment(const char *name, size_t size, unsigned int magic,
+                         void (*initialize)(void *segment, int argument),
+                         int argument);
+void initialize_work_queue(void *segment, int argument);
+struct work_queue *open_work_queue(void);
+void wait_semaphore(sem_t *semaphore);
+void initialize_semaphore(void *segment, int permits);
+void lock_work_queue(struct work_queue *queue);
+void submit_command(struct command *user_command);
+void run_worker(struct command *user_command);
+void handle_sigalrm(int signal);
+void forward_signal(int signal);
+int run_lock(char **arguments, struct builtin_context *context);
+int run_semaphore(char **arguments, struct builtin_context *context);
+int open_private_directory(const char *name);
+unsigned long hash_job_identity(char **job_command);
+int read_once_result(int output_fd, int result_fd);
+int run_once(char **arguments, struct builtin_context *context);
+int run_mkdir(char **arguments, struct builtin_context *context);
+bool mkdir_supported(char **arguments);
+int copy_file(const char *source, const char *target,
+              struct builtin_context *context);
+int run_cp(char **arguments, struct builtin_context *context);
+bool cp_supported(char **arguments);
+int run_fields(char **arguments, struct builtin_context *context);
+void load_timezone(void);
+size_t format_time(char *buffer, size_t size, const char *format,
+                   const struct timespec *time, bool utc);
+char *dynamic_variable(const char *name, char *buffer);
+int run_date(char **arguments, struct builtin_context *context);
+bool date_supported(char **arguments);
+int run_printf(char **arguments, struct builtin_context *context);
+bool printf_supported(char **arguments);
+bool compare_walk_value(char comparison, long long value, long long limit);
+bool walk_selects(struct walk_filter *filter, const char *name, char type,
+                  int directory_fd, const char *path);
+void add_walk_path(struct walk_state *state, const char *path, size_t length);
+void read_walk_directory(struct walk_state *state, const char *path,
+                         struct byte_buffer *output);
+void *run_walk_thread(void *argument);
+pid_t start_walk_batch(char **command, const char *path, char **batch);
+int wait_walk_batch(int *running, int exit_value);
+int run_walk(char **arguments, struct builtin_context *context);
+const struct builtin *find_builtin(char **arguments);
+bool builtin_supports(const struct builtin *builtin, char **arguments);
+unsigned long hash_name(const char *name, unsigned long seed);
+bool fill_registry(unsigned long size, unsigned long seed);
+void build_registry(void);
+const struct registry_entry *lookup_builtin(const char *name);
+const char *get_shell_variable(const char *name);
+void set_shell_variable(const char *name, const char *value);
+void enable_builtin(struct command *user_command);
+void show_status(struct command *user_command);
+void exit_shell(struct command *user_command);
+int open_redirection(struct command *user_command, int mode);
+void run_builtin(const struct builtin *builtin, struct command *user_command);
+void start_thread_job(const struct builtin *builtin,
+                      struct command *user_command);
+void *run_pool_thread(void *argument);
+bool cancel_thread_job(int job_id);
+void cancel_job(struct command *user_command);
+void set_pipe_size(int file_descriptor, int capacity);
+bool drain_pipe(int pipe_fd, int output_fd, size_t length);
+bool relay_tee(int input_fd, int *output_fds, int num_outputs);
+bool redirect_multios(struct command *user_command);
+int run_tee(char **arguments, struct builtin_context *context);
+void set_option(struct command *user_command);
+ssize_t read_proc_file(int file_descriptor, char *buffer, size_t size);
+void track_process(struct top_state *state, pid_t process_id, int job_index);
+bool sample_process(struct top_state *state, int index);
+void format_bytes(double bytes, char *buffer, size_t size);
+int show_top(pid_t *jobs, int num_jobs, double interval, int count);
+int run_jobs(char **arguments, struct builtin_context *context);
+
+/* Builtins run through the builtin_context interface */
+const struct builtin builtins[] = {
+  {"shard", run_shard, BUILTIN_FORKED},
+  {"pfor", run_pfor, BUILTIN_FORKED},
+  {"lock", run_lock, BUILTIN_FORKED},
+  {"sem", run_semaphore, BUILTIN_FORKED},
+  {"mkdir", run_mkdir, BUILTIN_THREAD_SAFE},
+  {"cp", run_cp, BUILTIN_THREAD_SAFE},
+  {"tee", run_tee, BUILTIN_FORKED},
+  {"jobs", run_jobs, BUILTIN_FORKED},
+  {"once", run_once, BUILTIN_FORKED},
+  {"fields", run_fields, BUILTIN_THREAD_SAFE},
+  {"date", run_date, BUILTIN_THREAD_SAFE},
+  {"printf", run_printf, BUILTIN_THREAD_SAFE},
+  {"walk", run_walk, BUILTIN_FORKED},
+  {NULL, NULL, 0}
+};
+
+/* Builtins that leave the options they do not support to the utility */
+const struct shadowed_utility shadowed_utilities[] = {
+  {run_mkdir, mkdir_supported},
+  {run_cp, cp_supported},
+  {run_date, date_supported},
+  {run_printf, printf_supported},
+  {NULL, NULL}
+};
+
+/* Builtins that change the state of the shell */
+const struct shell_builtin shell_builtins[] = {
+  {"status", show_status},
+  {"cd", change_directory},
+  {"exit", exit_shell},
+  {"submit", submit_command},
+  {"cancel", cancel_job},
+  {"set", set_option},
+  {"read", read_variables},
+  {"coproc", start_coprocess},
+  {"trap", set_trap},
+  {"alias", define_alias},
+  {"unalias", remove_alias},
+  {"enable", enable_builtin},
+  {"hash", hash_commands},
+  {"json", extract_json},
+  {"[[", test_condition},
+  {NULL, NULL}
+};
 
 /* Main */
-int main(void) {
+int main(int argc, char *argv[]) {
 
   // Ignore SIGCHLD for the shell
   sa_sigint.sa_handler = SIG_IGN;
@@ -105,17 +1046,55 @@ int main(void) {
   // Catching SIGTSTP for foreground-only mode
   sa_sigtstp.sa_handler = handle_sigtstp;
   sigfillset(&sa_sigtstp.sa_mask);
-  sigdelset(&sa_sigtstp.sa_mask, SIGCHLD);
   sa_sigtstp.sa_flags = 0;
   sigaction(SIGTSTP, &sa_sigtstp, NULL);
 
+  // Listen for SIGCHLD in order to reap zombie processes in the background.
+  // Pool threads raise it too when a background builtin finishes.
+  // Both handlers only set flags, the work happens at safe points.
+  sa_sigchld.sa_handler = handle_sigchld;
+  sigfillset(&sa_sigchld.sa_mask);
+  sa_sigchld.sa_flags = SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &sa_sigchld, NULL);
+
   struct command user_command;
   reset_command(&user_command, true);
+  build_registry();
+
+  // Worker instances run commands from the host-local work queue
+  if (argc > 1 && strcmp(argv[1], "--worker") == 0) {
+    run_worker(&user_command);
+    exit_and_cleanup(&user_command);
+    return 0;
+  }
+
+  // smallsh [--profile-lines] [SCRIPT]
+  int argument = 1;
+  if (argument < argc && strcmp(argv[argument], "--profile-lines") == 0) {
+    profiler.enabled = true;
+    argument++;
+  }
+  if (argument < argc) {
+    script_fd = open(argv[argument], O_RDONLY | O_CLOEXEC);
+    if (script_fd == -1) {
+      perror(argv[argument]);
+      return FAILURE;
+    }
+  }
+  script_mode = !isatty(script_fd);
   
   while (!program_status.exit_program) {
 
-    if (get_command(&user_command) == SUCCESS)
-      execute_command(&user_command);
+    if (get_command(&user_command) == SUCCESS) {
+      struct profile_sample sample;
+      start_profile_sample(&sample);
+      if (!run_parallel_block(&user_command))
+        execute_command(&user_command);
+      record_profile_sample(&sample);
+    }
+
+    // Safe point between commands
+    handle_pending_signals();
   }
 
   exit_and_cleanup(&user_command);
@@ -125,8 +1104,8 @@ int main(void) {
 /*
  * Function: get_command
  * -----------------------------------------------------------------------------
- * Prompt user for a command input, parse it, and 
- *   store the information in the given pointer to user_command.
+ * Report finished background jobs, prompt user for a command input,
+ *   parse it, and store the information in the given pointer to user_command.
  * Returns SUCCESS (0) if the command has be parsed and saved in user_command
  * Returns FAILURE (1) if the user input is blank or a command.
  */
@@ -134,58 +1113,244 @@ int get_command(struct command *user_command) {
 
   reset_command(user_command, false);
 
-  // Prompt for command
+  // Report finished background jobs, then prompt for command
+  flush_notifications();
   printf(": ");
   fflush(stdout);
 
-  char *input_buffer = (char *)calloc(MAX_COMMAND_LENGTH, sizeof(char));
-  size_t input_size = MAX_COMMAND_LENGTH;
-  int num_chars = getline(&input_buffer, &input_size, stdin);
-  if (num_chars == -1)
-    clearerr(stdin);
+  // Read more input only when no complete line is buffered already
+  char *input_line;
+  while (!(input_line = next_line(&input_parser))) {
+    int num_chars = fill_parser(&input_parser, script_fd);
+
+    // Stop the program once the input is exhausted
+    if (num_chars == 0 && !next_line_pending(&input_parser)) {
+      program_status.exit_program = true;
+      return FAILURE;
+    }
+
+    // Interrupted by a signal. A finished job only ends the wait for input
+    // when it is reported right away (set -b) or the CHLD trap is set.
+    if (num_chars == -1 && (program_status.notify || trap_commands[SIGCHLD] ||
+                            other_signals_pending(SIGCHLD)))
+      return FAILURE;
+  }
+
+  // Remember the source of the line before parsing splits it
+  if (profiler.enabled) {
+    profiler.current_line = input_parser.line_number;
+    struct line_profile *line = profile_line(profiler.current_line);
+    if (!line->text)
+      line->text = strdup(input_line);
+  }
+
+  return parse_command(input_line, user_command);
+}
+
+/*
+ * Function: parse_command
+ * -----------------------------------------------------------------------------
+ * Take a complete input line and a pointer to user_command as parameters,
+ *   parse the line and store the information in user_command.
+ * Returns SUCCESS (0) if the command has be parsed and saved in user_command
+ * Returns FAILURE (1) if the line is blank or a comment.
+ */
+int parse_command(char *input_line, struct command *user_command) {
 
   // Parse user input and store information
   int arg_index = 0;
-  char *token;
-  char *save_ptr = input_buffer;
-  token = strtok_r(input_buffer, " \n", &save_ptr);
+  int num_extra_outputs = 0;
+  char *tokens[MAX_ARGS];
+  int num_tokens = 0;
+  char *save_ptr = input_line;
+  char *token = strtok_r(input_line, " \n", &save_ptr);
+  struct variable *array;
 
   // Handle comment or blank input
-  bool is_comment = strncmp(input_buffer, "#", 1) == 0;
+  bool is_comment = strncmp(input_line, "#", 1) == 0;
   bool is_blank_line = (bool)!token;
-  if (is_comment || is_blank_line) {
-    free(input_buffer);
+  if (is_comment || is_blank_line)
     return FAILURE;
+
+  while (token != NULL && num_tokens < MAX_ARGS) {
+    tokens[num_tokens++] = token;
+    token = strtok_r(NULL, " \n", &save_ptr);
   }
+  num_tokens = expand_alias(tokens, num_tokens);
+
+  // The loop variable of pfor is substituted by pfor for each item
+  const char *loop_variable = num_tokens > 1 &&
+                              strcmp(tokens[0], "pfor") == 0 ? tokens[1] : NULL;
 
-  while (token != NULL) {
+  for (int i = 0; i < num_tokens; i++) {
+    token = tokens[i];
 
     // Input Redirection
     if (strcmp(token, "<") == 0) {
-      token = strtok_r(NULL, " \n", &save_ptr);
-      user_command->input_file = expand_variable(token);
+      if (++i == num_tokens)
+        break;
+      user_command->input_file = expand_variable(tokens[i]);
 
     // Output Redirection
     } else if (strcmp(token, ">") == 0) {
-      token = strtok_r(NULL, " \n", &save_ptr);
-      user_command->output_file = expand_variable(token);
+      if (++i == num_tokens)
+        break;
+
+      // Further output files receive a copy of the output
+      if (!user_command->output_file) {
+        user_command->output_file = expand_variable(tokens[i]);
+      } else if (num_extra_outputs < MAX_OUTPUT_FILES - 1) {
+        user_command->extra_output_files[num_extra_outputs++] =
+          expand_variable(tokens[i]);
+      }
+
+    // Descriptor duplication, such as >&${NAME[1]} for a coprocess
+    } else if (strncmp(token, "<&", 2) == 0 || strncmp(token, ">&", 2) == 0) {
+      bool input = token[0] == '<';
+      char *descriptor = token[2] ? expand_variable(token + 2) : NULL;
+      if (!descriptor && ++i < num_tokens)
+        descriptor = expand_variable(tokens[i]);
+      if (!descriptor)
+        break;
+      if (input)
+        user_command->input_descriptor = atoi(descriptor);
+      else
+        user_command->output_descriptor = atoi(descriptor);
+      free(descriptor);
 
     // Run in the background if the foreground-only mode is off
-    } else if (strcmp(token, "&") == 0 && strcmp(save_ptr, "\0") == 0) {
+    } else if (strcmp(token, "&") == 0 && i == num_tokens - 1) {
       user_command->background = !program_status.foreground_only;
 
+    // A whole array, "${NAME[@]}", is one argument per element
+    } else if ((array = find_array_reference(token)) &&
+               !(loop_variable && strcmp(array->name, loop_variable) == 0)) {
+      for (int j = 0; j < array->num_values && arg_index < MAX_ARGS - 1; j++)
+        user_command->arguments[arg_index++] = strdup(array->values[j]);
+
     // Command arguments
-    } else {
+    } else if (arg_index < MAX_ARGS - 1) {
 
-      user_command->arguments[arg_index] = expand_variable(token);
+      user_command->arguments[arg_index] = expand_word(token, loop_variable);
       arg_index++;
     }
-    token = strtok_r(NULL, " \n", &save_ptr);
   }
-  free(input_buffer);
+
+  // Redirections alone do not make a command
+  if (arg_index == 0)
+    return FAILURE;
+
   return SUCCESS;
 }
 
+/*
+ * Function: fill_parser
+ * -----------------------------------------------------------------------------
+ * Take a pointer to the parser state and a file descriptor as parameters,
+ *   read the next chunk of input into the free space of the buffer.
+ * The consumed prefix is dropped first, so the buffer only ever holds the
+ *   unfinished suffix of the input plus the newly read chunk.
+ * Returns the number of bytes read, 0 at the end of input,
+ *   or -1 if the read has been interrupted by a signal.
+ */
+int fill_parser(struct parser *state, int file_descriptor) {
+
+  if (state->end_of_input)
+    return 0;
+
+  // Move the unfinished suffix to the front of the buffer
+  if (state->start > 0) {
+    memmove(state->buffer, state->buffer + state->start,
+            state->end - state->start);
+    state->end -= state->start;
+    state->start = 0;
+  }
+
+  // The unfinished line fills the whole buffer, drop it
+  if (state->end == MAX_COMMAND_LENGTH) {
+    if (!state->discarding) {
+      printf("command too long, ignoring the rest of the line\n");
+      fflush(stdout);
+    }
+    state->discarding = true;
+    state->end = 0;
+  }
+
+  size_t free_space = MAX_COMMAND_LENGTH - state->end;
+  if (free_space > READ_CHUNK_SIZE)
+    free_space = READ_CHUNK_SIZE;
+
+  ssize_t num_bytes = read(file_descriptor, state->buffer + state->end,
+                           free_space);
+  if (num_bytes == -1)
+    return -1;
+
+  if (num_bytes == 0) {
+    state->end_of_input = true;
+    return 0;
+  }
+
+  state->end += num_bytes;
+  return num_bytes;
+}
+
+/*
+ * Function: next_line_pending
+ * -----------------------------------------------------------------------------
+ * Take a pointer to the parser state as parameter.
+ * Returns true if any unconsumed bytes are left in the buffer.
+ */
+bool next_line_pending(struct parser *state) {
+
+  return state->start < state->end;
+}
+
+/*
+ * Function: next_line
+ * -----------------------------------------------------------------------------
+ * Take a pointer to the parser state as parameter and
+ *   hand out the next complete line in the buffer, without its newline.
+ * At the end of input, the unterminated last line counts as complete.
+ * The returned string lives in the buffer until the next call to fill_parser.
+ * Returns NULL if no complete line has been buffered yet.
+ */
+char *next_line(struct parser *state) {
+
+  while (state->start < state->end) {
+    char *line_start = state->buffer + state->start;
+    char *newline = memchr(line_start, '\n', state->end - state->start);
+
+    if (!newline) {
+
+      if (!state->end_of_input)
+        return NULL;
+
+      // Last line without a trailing newline
+      state->start = state->end;
+      state->line_number++;
+      if (state->discarding) {
+        state->discarding = false;
+        return NULL;
+      }
+      state->buffer[state->end] = '\0';
+      return line_start;
+    }
+
+    *newline = '\0';
+    state->start = newline - state->buffer + 1;
+    state->line_number++;
+
+    // Tail of an overlong line
+    if (state->discarding) {
+      state->discarding = false;
+      continue;
+    }
+    return line_start;
+  }
+
+  return NULL;
+}
+
 /*
  * Function: reset_command
  * -----------------------------------------------------------------------------
@@ -218,6 +1383,14 @@ void reset_command(struct command *user_command, bool initialize) {
     free(user_command->output_file);
   user_command->output_file = NULL;
 
+  for (int i = 0; i < MAX_OUTPUT_FILES; i++) {
+    if (!initialize)
+      free(user_command->extra_output_files[i]);
+    user_command->extra_output_files[i] = NULL;
+  }
+
+  user_command->input_descriptor = -1;
+  user_command->output_descriptor = -1;
   user_command->background = false;
 }
 
@@ -225,437 +1398,6657 @@ void reset_command(struct command *user_command, bool initialize) {
  * Function: expand_variable
  * -----------------------------------------------------------------------------
  * Get a pointer to a string as parameter,
- *   replace all instances of "$$" with the process ID of the program.
- * Reallocate enough memory for the new string as necessary and
- *   return the pointer to the expanded string.
+ *   replace all instances of "$$" with the process ID of the program, and
+ *   "$NAME", "${NAME}" and "${NAME[INDEX]}" with the value of the shell
+ *   variable or environment variable NAME ("${NAME[@]}" for all elements).
+ * EPOCHSECONDS and EPOCHREALTIME are computed each time, see dynamic_variable.
+ * References to unset variables are left as they are.
+ * Return the pointer to the newly allocated expanded string.
  */
 char *expand_variable(char *unexpanded_string) {
 
-  int num_digits_pid = floor(log10(getpid())) + 1;
-  int variable_start;
-  char *current_string = calloc(strlen(unexpanded_string), sizeof(char));
-  strcpy(current_string, unexpanded_string);
-  variable_start = strstr(current_string, "$$") - current_string;
-
-  while (variable_start >= 0 && variable_start < strlen(current_string)) {
-
-    // Substring on the left of $$
-    char expanded_string_left[variable_start+1];
-    strncpy(expanded_string_left, "", sizeof(expanded_string_left));
-    strncpy(expanded_string_left, current_string, variable_start);
-
-    // Substring on the right of $$
-    char expanded_string_right[strlen(current_string) - variable_start - 1];
-    strncpy(expanded_string_right, "", sizeof(expanded_string_right));
-    strncpy(expanded_string_right, current_string + variable_start + 2, 
-            strlen(current_string) - variable_start - 2);
-
-    // Create expanded string
-    int length_expanded_string = strlen(current_string) + num_digits_pid - 1;
-    current_string = realloc(current_string, 
-                             length_expanded_string * sizeof(char));
-    sprintf(current_string, "%s%d%s", expanded_string_left, getpid(), 
-            expanded_string_right);
-
-    variable_start = strstr(current_string, "$$") - current_string;
-  };
-  
-  return current_string;
+  return expand_word(unexpanded_string, NULL);
 }
 
 /*
- * Function: execute_command
+ * Function: expand_word
  * -----------------------------------------------------------------------------
- * Take a pointer to user_command as parameter.
- * Execute status, cd, and exit commands in the foreground and
- *   create a new process and execute for other commands.
+ * Takes a string and the name of a variable to keep, or NULL, as parameters.
+ * Expand the string as expand_variable does, leaving references to the kept
+ *   variable as they are, such as the loop variable of pfor, which pfor
+ *   substitutes itself.
+ * Return the pointer to the newly allocated expanded string.
  */
-void execute_command(struct command *user_command) {
+char *expand_word(char *unexpanded_string, const char *kept_name) {
 
-  char *first_argument = user_command->arguments[0];
-  
-  if (strcmp(first_argument, "status") == 0) {
-    report_status();
+  struct byte_buffer expanded = {NULL, 0, 0};
+  char *current = unexpanded_string;
+
+  while (*current) {
+    char *dollar = strchr(current, '$');
+    if (!dollar) {
+      append_buffer(&expanded, current, strlen(current));
+      break;
+    }
+    append_buffer(&expanded, current, dollar - current);
+    current = dollar + 1;
 
-  } else if (strncmp(first_argument, "cd", 2) == 0) {
-    change_directory(user_command);
+    // Process ID of the program
+    if (*current == '$') {
+      char pid_string[16];
+      int length = snprintf(pid_string, sizeof(pid_string), "%d", getpid());
+      append_buffer(&expanded, pid_string, length);
+      current++;
+      continue;
+    }
 
-  } else if (strcmp(first_argument, "exit") == 0) {
-    program_status.exit_program = true;
+    // Variable name, index and end of the reference
+    bool braced = *current == '{';
+    char *name_start = current + braced;
+    char *name_end = name_start;
+    while (isalnum((unsigned char)*name_end) || *name_end == '_')
+      name_end++;
 
-  } else {
-    fork_and_execute(user_command);
+    char *index_start = NULL;
+    char *reference_end = name_end;
+    if (braced && *name_end == '[' && (reference_end = strchr(name_end, ']')))
+      index_start = name_end + 1;
+    if (braced && reference_end)
+      reference_end = *(reference_end + (index_start != NULL)) == '}' ?
+                      reference_end + (index_start != NULL) + 1 : NULL;
+
+    char name[MAX_VARIABLE_NAME];
+    char dynamic_value[32];
+    size_t name_length = name_end - name_start;
+    struct variable *found = NULL;
+    char *environment_value = NULL;
+    if (name_length > 0 && name_length < sizeof(name) && reference_end &&
+        !isdigit((unsigned char)*name_start)) {
+      memcpy(name, name_start, name_length);
+      name[name_length] = '\0';
+      if ((!kept_name || strcmp(name, kept_name) != 0) &&
+          !(environment_value = dynamic_variable(name, dynamic_value)) &&
+          !(found = find_variable(name)))
+        environment_value = getenv(name);
+    }
+
+    // Unset variables and anything else after "$" are kept literally
+    if (!found && !environment_value) {
+      append_buffer(&expanded, "$", 1);
+      continue;
+    }
+
+    if (found && index_start && *index_start == '@') {
+      for (int i = 0; i < found->num_values; i++) {
+        if (i > 0)
+          append_buffer(&expanded, " ", 1);
+        append_buffer(&expanded, found->values[i], strlen(found->values[i]));
+      }
+    } else if (found) {
+      int index = index_start ? atoi(index_start) : 0;
+      if (index >= 0 && index < found->num_values)
+        append_buffer(&expanded, found->values[index],
+                      strlen(found->values[index]));
+    } else if (!index_start || atoi(index_start) == 0) {
+      append_buffer(&expanded, environment_value, strlen(environment_value));
+    }
+    current = reference_end;
   }
+
+  append_buffer(&expanded, "", 1);
+  return expanded.data;
 }
 
 /*
- * Function: change_directory
+ * Function: find_array_reference
  * -----------------------------------------------------------------------------
- * Take a pointer to the user_command and change the current working directory.
- * If there is no argument after cd, 
- *   it will change the current working directory to the home directory.
- * Otherwise, it will change it to the first argument after cd.
+ * Takes a word as parameter.
+ * Returns the shell variable NAME if the word is exactly "${NAME[@]}",
+ *   otherwise NULL.
  */
-void change_directory(struct command *user_command) {
-
-  char *path = user_command->arguments[1];
+struct variable *find_array_reference(const char *word) {
 
-  if (!path) {
-    path = getenv("HOME");
-  }
+  char name[MAX_VARIABLE_NAME];
+  size_t length = strlen(word);
+  if (length < 7 || length - 6 >= sizeof(name) ||
+      strncmp(word, "${", 2) != 0 || strcmp(word + length - 4, "[@]}") != 0)
+    return NULL;
 
-  chdir(path);
+  memcpy(name, word + 2, length - 6);
+  name[length - 6] = '\0';
+  return find_variable(name);
 }
 
 /*
- * Function: report_status
+ * Function: find_variable
  * -----------------------------------------------------------------------------
- * Take a pointer to and report the exit status or terminating signal of 
- *   the last foregound process.
+ * Takes a variable name as parameter.
+ * Returns the shell variable with that name, or NULL if it is not set.
  */
-void report_status(void) {
+struct variable *find_variable(const char *name) {
 
-  if (program_status.kill_signal) {
-    write(STDOUT_FILENO, "terminated by signal ", 21);
-    write_integer(program_status.kill_signal);
+  for (struct variable *current = shell_variables; current;
+       current = current->next) {
+    if (strcmp(current->name, name) == 0)
+      return current;
+  }
+  return NULL;
+}
+
+/*
+ * Function: set_variable
+ * -----------------------------------------------------------------------------
+ * Takes a variable name, an array of values and the number of values.
+ * Set the shell variable to copies of the values, creating it if needed.
+ * A single value makes a plain variable, several values an array.
+ */
+void set_variable(const char *name, char **values, int num_values) {
 
+  struct variable *found = find_variable(name);
+  if (!found) {
+    found = calloc(1, sizeof(struct variable));
+    found->name = strdup(name);
+    found->next = shell_variables;
+    shell_variables = found;
   } else {
-    write(STDOUT_FILENO, "exit value ", 11);
-    write_integer(program_status.exit_status);
+    for (int i = 0; i < found->num_values; i++)
+      free(found->values[i]);
+    free(found->values);
   }
 
-  write(STDOUT_FILENO, "\n", 1);
+  found->values = calloc(num_values + 1, sizeof(char *));
+  for (int i = 0; i < num_values; i++)
+    found->values[i] = strdup(values[i]);
+  found->num_values = num_values;
 }
 
 /*
- * Function: exit_and_cleanup
+ * Function: assign_variable
  * -----------------------------------------------------------------------------
- * Take a pointer to user_command as parameter, 
- *   free all allocated memory and kill all child processes.
- * Also kill and free the memory of all running background processes.
+ * Take a pointer to user_command as parameter.
+ * If the command is a single NAME=VALUE word, set the shell variable.
+ * Returns true if the command was an assignment.
  */
-void exit_and_cleanup(struct command *user_command) {
+bool assign_variable(struct command *user_command) {
 
-  reset_command(user_command, false);
+  char *word = user_command->arguments[0];
+  char *equals = strchr(word, '=');
+  if (!equals || equals == word || user_command->arguments[1])
+    return false;
 
-  while (program_status.background) {
-    kill(program_status.background->process_id, SIGTERM);
-    pop_background_process(program_status.background->process_id);
+  for (char *current = word; current < equals; current++) {
+    if (!isalnum((unsigned char)*current) && *current != '_')
+      return false;
   }
+  if (isdigit((unsigned char)word[0]))
+    return false;
+
+  *equals = '\0';
+  char *value = equals + 1;
+  set_variable(word, &value, 1);
+  *equals = '=';
+  program_status.exit_status = SUCCESS;
+  return true;
 }
 
 /*
- * Function: fork_and_execute
+ * Function: read_variables
  * -----------------------------------------------------------------------------
- * Take a pointer to user_command as parameter, 
- *   create a child process to execute the arguments
- *   in the background or the foreground based on user input.
- * Also update/add the foreground and background process to program_status.
+ * Take a pointer to user_command as parameter:
+ *   read [-u FD] NAME...
+ * Read one line from FD (stdin by default) and assign its whitespace
+ *   separated words to the NAMEs, the last NAME taking the rest of the line.
+ * Other descriptors are read one byte at a time, so nothing after the line
+ *   is consumed, e.g. from a coprocess. Stdin is read through the command
+ *   parser, so a script reads its own next line.
  */
-void fork_and_execute(struct command *user_command) {
-  
-  // int child_exit_method;
-  pid_t spwan_pid = fork();
+void read_variables(struct command *user_command) {
 
-  switch(spwan_pid) {
+  int file_descriptor = STDIN_FILENO;
+  int first_name = 1;
+  char **arguments = user_command->arguments;
+  if (arguments[1] && strcmp(arguments[1], "-u") == 0 && arguments[2]) {
+    file_descriptor = atoi(arguments[2]);
+    first_name = 3;
+  }
 
-    // Forking error
-    case -1:
+  if (!arguments[first_name]) {
+    fprintf(stderr, "usage: read [-u FD] NAME...\n");
+    program_status.exit_status = FAILURE;
+    return;
+  }
 
-      perror("fork() failed\n");
-      exit(FAILURE);
+  // Read the line
+  char line[MAX_COMMAND_LENGTH];
+  size_t length = 0;
+  bool complete = false;
+  if (file_descriptor == STDIN_FILENO && script_fd == STDIN_FILENO) {
+    char *input_line;
+    int num_chars = 1;
+    while (!(input_line = next_line(&input_parser)) && num_chars != 0)
+      num_chars = fill_parser(&input_parser, STDIN_FILENO);
+    if (input_line) {
+      snprintf(line, sizeof(line), "%s", input_line);
+      length = strlen(line);
+      complete = true;
+    }
+  } else {
+    char character;
+    ssize_t num_bytes;
+    while (length < sizeof(line) - 1 &&
+           ((num_bytes = read(file_descriptor, &character, 1)) == 1 ||
+            (num_bytes == -1 && errno == EINTR))) {
+      if (num_bytes != 1)
+        continue;
+      if (character == '\n') {
+        complete = true;
+        break;
+      }
+      line[length++] = character;
+    }
+  }
+  line[length] = '\0';
 
-    // Child process
-    case 0:
+  // Split the line into the variables
+  char *current = line;
+  for (int i = first_name; arguments[i]; i++) {
+    while (*current == ' ' || *current == '\t')
+      current++;
+    char *word = current;
+    if (arguments[i + 1]) {
+      while (*current && *current != ' ' && *current != '\t')
+        current++;
+      if (*current)
+        *current++ = '\0';
+    }
+    set_variable(arguments[i], &word, 1);
+  }
 
-      // Only foreground process should listen for SIGINT
-      if (!user_command->background) {
-        sa_sigint.sa_handler = SIG_DFL;
-        sigaction(SIGINT, &sa_sigint, NULL);
-      }
+  program_status.exit_status = complete || length > 0 ? SUCCESS : FAILURE;
+  program_status.kill_signal = 0;
+}
 
-      // Both foreground and background processes should ignore SIGTSTP
-      sa_sigtstp.sa_handler = SIG_IGN;
-      sigaction(SIGTSTP, &sa_sigtstp, NULL);
+/*
+ * Function: parse_json
+ * -----------------------------------------------------------------------------
+ * Take a pointer to a mapped JSON document as parameter.
+ * Parse the document into its nodes in a single pass without copying:
+ *   strings are found with memchr, which the C library vectorizes, and only
+ *   decoded when they are extracted.
+ * Returns SUCCESS if the document is valid JSON.
+ */
+int parse_json(struct json_document *document) {
 
-      if (!redirect(user_command, INPUT) || !redirect(user_command, OUTPUT))
-        exit(FAILURE);
-      
-      execvp(user_command->arguments[0], user_command->arguments);
-      perror(user_command->arguments[0]);
-      exit(FAILURE);
+  enum {EXPECT_VALUE, EXPECT_KEY, EXPECT_COLON, EXPECT_COMMA};
+  const char *data = document->data;
+  size_t length = document->size;
+  size_t position = 0;
+  int state = EXPECT_VALUE;
+  bool empty = false;
+  int capacity = 64;
+  int *open = NULL;
+  int depth = 0;
 
-    // Parent Process
-    default:
+  document->nodes = malloc(capacity * sizeof(struct json_node));
+  document->num_nodes = 0;
 
-      // Listen for SIGCHLD in order to reap zombie processes in the background.
-      sa_sigchld.sa_handler = (void *)handle_sigchld;
-      sigfillset(&sa_sigchld.sa_mask);
-      sa_sigchld.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-      sigaction(SIGCHLD, &sa_sigchld, NULL);
+  while (true) {
+    while (position < length && (data[position] == ' ' ||
+           data[position] == '\t' || data[position] == '\n' ||
+           data[position] == '\r'))
+      position++;
+    if (position == length)
+      break;
 
-      // Background process
-      if (user_command->background) {
+    char character = data[position];
+    char parent = depth ? document->nodes[open[depth - 1]].type : '\0';
 
-        // Adding background pid to program_status
-        push_background_process(spwan_pid);
-        printf("background pid is %d\n", spwan_pid);
-        fflush(stdout);
+    // Close the innermost object or array, possibly empty
+    if ((character == '}' && parent == '{' &&
+         (state == EXPECT_COMMA || (state == EXPECT_KEY && empty))) ||
+        (character == ']' && parent == '[' &&
+         (state == EXPECT_COMMA || (state == EXPECT_VALUE && empty)))) {
+      struct json_node *closed = &document->nodes[open[--depth]];
+      closed->end = ++position;
+      closed->next = document->num_nodes;
+      state = EXPECT_COMMA;
+      empty = false;
+      continue;
+    }
 
-      // Foreground process
-      } else {
+    if (state == EXPECT_COMMA) {
+      if (character != ',' || !depth)
+        break;
+      position++;
+      state = parent == '{' ? EXPECT_KEY : EXPECT_VALUE;
+      empty = false;
+      continue;
+    }
 
-        // Adding foreground pid to program_status
-        program_status.foreground = spwan_pid;
+    if (state == EXPECT_COLON) {
+      if (character != ':')
+        break;
+      position++;
+      state = EXPECT_VALUE;
+      continue;
+    }
+
+    if (state == EXPECT_KEY && character != '"')
+      break;
+
+    // A new value
+    if (document->num_nodes == capacity) {
+      capacity *= 2;
+      document->nodes = realloc(document->nodes,
+                                capacity * sizeof(struct json_node));
+    }
+    int index = document->num_nodes;
+    struct json_node *node = &document->nodes[index];
+    node->type = character;
+    node->start = position;
+    node->next = index + 1;
+
+    if (character == '{' || character == '[') {
+      if (depth % 64 == 0)
+        open = realloc(open, (depth + 64) * sizeof(int));
+      open[depth++] = index;
+      position++;
+      state = character == '{' ? EXPECT_KEY : EXPECT_VALUE;
+      empty = true;
 
-        // Pause program until the foreground process finishes
-        while (program_status.foreground)
-          pause();
+    } else if (character == '"') {
+      const char *quote = data + position + 1;
+      while ((quote = memchr(quote, '"', data + length - quote))) {
+        const char *backslash = quote;
+        while (backslash[-1] == '\\')
+          backslash--;
+        if ((quote - backslash) % 2 == 0)
+          break;
+        quote++;
       }
+      if (!quote)
+        break;
+      position = quote - data + 1;
+      state = state == EXPECT_KEY ? EXPECT_COLON : EXPECT_COMMA;
+
+    } else if (character == '-' || isdigit((unsigned char)character)) {
+      node->type = 'n';
+      while (position < length && strchr("+-.0123456789eE", data[position]) &&
+             data[position])
+        position++;
+      state = EXPECT_COMMA;
+
+    } else if ((length - position >= 4 &&
+                (memcmp(data + position, "true", 4) == 0 ||
+                 memcmp(data + position, "null", 4) == 0)) ||
+               (length - position >= 5 &&
+                memcmp(data + position, "false", 5) == 0)) {
+      node->type = character == 'n' ? 'l' : character;
+      position += character == 'f' ? 5 : 4;
+      state = EXPECT_COMMA;
+
+    } else {
+      break;
+    }
+
+    node->end = position;
+    document->num_nodes++;
   }
+
+  free(open);
+  return position == length && depth == 0 && document->num_nodes > 0 &&
+         state == EXPECT_COMMA ? SUCCESS : FAILURE;
 }
 
 /*
- * Function: handle_sigchld
+ * Function: free_json_document
  * -----------------------------------------------------------------------------
- * Listen and handle SIGCHLD signals returned by 
- *   both the background and foreground processes.
- * Also, report and/or update  exit value or termination signals as well as
- *   updating foreground/background processes in program_status.
+ * Take a pointer to a JSON document as parameter.
+ * Unmap the file and free the document.
  */
-void handle_sigchld(int signal) {
+void free_json_document(struct json_document *document) {
 
-  if (signal != SIGCHLD)
-    return;
+  if (document->data)
+    munmap(document->data, document->size);
+  free(document->nodes);
+  free(document);
+}
 
-  pid_t pid;
-  int exit_method;
+/*
+ * Function: load_json
+ * -----------------------------------------------------------------------------
+ * Take the path of a JSON file as parameter.
+ * Return the parsed document, from the cache while the device, inode,
+ *   modification time and size of the file are unchanged. Otherwise map and
+ *   parse the file and keep it in the cache of JSON_CACHE_SIZE documents.
+ * Returns NULL if the file cannot be read or is not valid JSON.
+ */
+struct json_document *load_json(const char *path) {
 
-  while ((pid = waitpid(-1, &exit_method, WNOHANG)) > 0) {
+  int file_descriptor = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat file_status;
+  if (file_descriptor == -1 || fstat(file_descriptor, &file_status) == -1) {
+    fprintf(stderr, "json: %s: %s\n", path, strerror(errno));
+    if (file_descriptor != -1)
+      close(file_descriptor);
+    return NULL;
+  }
 
-    // Background process
-    if (pop_background_process(pid)) {
+  // Reuse the parsed document, dropping it if the file has changed
+  struct json_document **link = &json_documents;
+  for (struct json_document *current = *link; current;
+       link = &current->next, current = *link) {
+    if (current->device != file_status.st_dev ||
+        current->inode != file_status.st_ino)
+      continue;
+    *link = current->next;
+    if (current->modified.tv_sec == file_status.st_mtim.tv_sec &&
+        current->modified.tv_nsec == file_status.st_mtim.tv_nsec &&
+        current->size == file_status.st_size) {
+      close(file_descriptor);
+      current->next = json_documents;
+      json_documents = current;
+      return current;
+    }
+    free_json_document(current);
+    break;
+  }
 
-      // Report exiting background process
-      write(STDOUT_FILENO, "background pid ", 15);
-      write_integer(pid);
-      write(STDOUT_FILENO, " is done: ", 10);
+  struct json_document *document = calloc(1, sizeof(struct json_document));
+  document->device = file_status.st_dev;
+  document->inode = file_status.st_ino;
+  document->modified = file_status.st_mtim;
+  document->size = file_status.st_size;
+  if (document->size > 0) {
+    document->data = mmap(NULL, document->size, PROT_READ, MAP_PRIVATE,
+                          file_descriptor, 0);
+    if (document->data == MAP_FAILED) {
+      fprintf(stderr, "json: %s: %s\n", path, strerror(errno));
+      document->data = NULL;
+      document->size = 0;
+    }
+  }
+  close(file_descriptor);
 
-      // Normal exit
-      if (WIFEXITED(exit_method)) {
-        write(STDOUT_FILENO, "exit value ", 11);
-        write_integer(WEXITSTATUS(exit_method));
-      }
+  if (!document->data || parse_json(document) == FAILURE) {
+    fprintf(stderr, "json: %s: invalid JSON\n", path);
+    free_json_document(document);
+    return NULL;
+  }
 
-      // Exited by interruption
-      if (WIFSIGNALED(exit_method)) {      
-        write(STDOUT_FILENO, "terminated by signal ", 21);
-        write_integer(WTERMSIG(exit_method));
-      }
-      write(STDOUT_FILENO, "\n", 1);
+  // Keep the most recently used documents
+  document->next = json_documents;
+  json_documents = document;
+  int num_documents = 0;
+  for (link = &json_documents; *link; link = &(*link)->next) {
+    if (++num_documents > JSON_CACHE_SIZE) {
+      free_json_document(*link);
+      *link = NULL;
+      break;
+    }
+  }
+  return document;
+}
 
-    // Foreground process
-    } else {
+/*
+ * Function: json_key_equals
+ * -----------------------------------------------------------------------------
+ * Take a JSON document, the node of an object key, a name and its length
+ *   as parameters.
+ * Returns true if the key is the name.
+ */
+bool json_key_equals(struct json_document *document, int key,
+                     const char *name, size_t length) {
 
-      // Normal exit
-      if (WIFEXITED(exit_method)) {
-        program_status.exit_status = WEXITSTATUS(exit_method);
-        program_status.kill_signal = 0;
-      }
+  struct json_node *node = &document->nodes[key];
+  const char *raw = document->data + node->start + 1;
+  size_t raw_length = node->end - node->start - 2;
 
-      // Exited by interruption
-      if (WIFSIGNALED(exit_method)) {
-        program_status.kill_signal = WTERMSIG(exit_method);
-        program_status.exit_status = 0;
-        report_status();
-      }
+  if (!memchr(raw, '\\', raw_length))
+    return raw_length == length && memcmp(raw, name, length) == 0;
 
-      program_status.foreground = 0;
-    }
-  }
+  char *decoded = json_value(document, key);
+  bool equals = strlen(decoded) == length && memcmp(decoded, name, length) == 0;
+  free(decoded);
+  return equals;
 }
 
 /*
- * Function: handle_sigtstp
+ * Function: query_json
  * -----------------------------------------------------------------------------
- * Listen and handle SIGTSTP signals returned by the terminal.
- * Toggle foreground-only mode upon receive and display the status
- *   when there is no foreground process running.
+ * Take a JSON document, a node, a query and the results found so far
+ *   as parameters. A query is a sequence of
+ *   .NAME - the member NAME of an object
+ *   [N] - element N of an array
+ *   [] - every element of an array or every member of an object
+ * Add the nodes the query selects from node to results.
+ * Returns the number of results, or -1 if the query is invalid.
  */
-void handle_sigtstp(int signal) {
+int query_json(struct json_document *document, int node, const char *query,
+               int *results, int num_results) {
 
-  // Toggle foreground-only mode
-  program_status.foreground_only = !program_status.foreground_only;
+  struct json_node *nodes = document->nodes;
 
-  // Display the status fg-only mode when there is not a foreground process.
-  while (program_status.foreground) {};
-  if (program_status.foreground_only) {
-    write(STDOUT_FILENO, 
-          "\nEntering foreground-only mode (& is now ignored)\n", 50);
-  } else {
-    write(STDOUT_FILENO, "\nExiting foreground-only mode\n", 30);
+  if (*query == '.')
+    query++;
+  if (*query == '\0') {
+    results[num_results++] = node;
+    return num_results;
+  }
+
+  if (*query != '[') {
+    size_t length = strcspn(query, ".[");
+    if (nodes[node].type != '{')
+      return num_results;
+    for (int key = node + 1; key < nodes[node].next;
+         key = nodes[key + 1].next) {
+      if (json_key_equals(document, key, query, length))
+        return query_json(document, key + 1, query + length, results,
+                          num_results);
+    }
+    return num_results;
+  }
+
+  char *index_end;
+  long index = strtol(query + 1, &index_end, 10);
+  bool every = index_end == query + 1;
+  if (*index_end != ']' || index < 0)
+    return -1;
+  if (nodes[node].type != '[' && !(every && nodes[node].type == '{'))
+    return num_results;
+
+  // Members of an object are key and value pairs
+  int step = nodes[node].type == '{';
+  for (int element = node + 1; element < nodes[node].next;
+       element = nodes[element + step].next, index--) {
+    if (every || index == 0)
+      num_results = query_json(document, element + step, index_end + 1,
+                               results, num_results);
+    if (num_results == -1 || (!every && index == 0))
+      break;
   }
+  return num_results;
 }
 
 /*
- * Function: push_background_process
+ * Function: json_value
  * -----------------------------------------------------------------------------
- * Takes a background process pid as parameter.
- * Create a process node with the provided pid and 
- *   add the node to the end of the background process linked list.
+ * Take a JSON document and a node as parameters.
+ * Returns a newly allocated string with the decoded text of a string, and
+ *   the JSON text of any other value.
  */
-void push_background_process(pid_t process_id) {
+char *json_value(struct json_document *document, int node) {
 
-  // Create new node
-  struct process *new_background_process = (struct process *)
-                                           malloc(sizeof(struct process));
-  new_background_process->process_id = process_id;
-  new_background_process->next = NULL;
+  struct json_node *value = &document->nodes[node];
+  const char *data = document->data;
+  if (value->type != '"')
+    return strndup(data + value->start, value->end - value->start);
 
-  // Add node to head if not exist
-  if (!program_status.background) {
-    program_status.background = new_background_process;
-    return;
-  }
+  struct byte_buffer decoded = {NULL, 0, 0};
+  size_t end = value->end - 1;
+  for (size_t position = value->start + 1; position < end; position++) {
+    const char *backslash = memchr(data + position, '\\', end - position);
+    size_t length = (backslash ? backslash - data : end) - position;
+    append_buffer(&decoded, data + position, length);
+    position += length;
+    if (!backslash || position + 1 >= end)
+      break;
 
-  // Add node to the last location of the linked list
-  struct process *current_background_process = program_status.background;
-  while (current_background_process->next) {
-    current_background_process = current_background_process->next;
+    char escaped = data[++position];
+    char *replacement = strchr("b\bf\fn\nr\rt\t", escaped);
+    if (escaped == 'u' && position + 4 < end) {
+      char hex[5] = {0};
+      unsigned code = strtoul(memcpy(hex, data + position + 1, 4), NULL, 16);
+      position += 4;
+
+      // Characters outside the basic plane are escaped as surrogate pairs
+      if (code >= 0xD800 && code < 0xDC00 && position + 6 < end &&
+          data[position + 1] == '\\' && data[position + 2] == 'u') {
+        unsigned low = strtoul(memcpy(hex, data + position + 3, 4), NULL, 16);
+        if (low >= 0xDC00 && low < 0xE000) {
+          code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+          position += 6;
+        }
+      }
+
+      char utf8[4];
+      int num_bytes = code < 0x80 ? 1 : code < 0x800 ? 2 :
+                      code < 0x10000 ? 3 : 4;
+      for (int i = num_bytes - 1; i > 0; i--, code >>= 6)
+        utf8[i] = 0x80 | (code & 0x3F);
+      utf8[0] = num_bytes == 1 ? code : ((0xF00 >> num_bytes) & 0xFF) | code;
+      append_buffer(&decoded, utf8, num_bytes);
+    } else if (escaped && replacement &&
+               (replacement - "b\bf\fn\nr\rt\t") % 2 == 0) {
+      append_buffer(&decoded, replacement + 1, 1);
+    } else {
+      append_buffer(&decoded, &escaped, 1);
+    }
   }
 
-  current_background_process->next = new_background_process;
+  append_buffer(&decoded, "", 1);
+  return decoded.data;
 }
 
 /*
- * Function: pop_background_process
+ * Function: extract_json
  * -----------------------------------------------------------------------------
- * Takes a process pid as parameter.
- * Remove/free the node from the background process linked list if available.
- * Return true if the node has been removed from the background processes.
- * Return false if there is no background processes matching the provided pid.
+ * Take a pointer to user_command as parameter:
+ *   json FILE QUERY [NAME]
+ * Select values of the JSON file with the query (see query_json), and print
+ *   them one per line, or assign them to the shell variable NAME, as an
+ *   array when the query has several results, so that pfor can iterate
+ *   over "${NAME[@]}". Repeated queries of an unchanged file reuse the
+ *   parsed document instead of parsing it again.
  */
-bool pop_background_process(pid_t process_id) {
+void extract_json(struct command *user_command) {
 
-  // No background processes currently
-  if (!program_status.background) {
-    return false;
+  char **arguments = user_command->arguments;
+  program_status.exit_status = FAILURE;
+  program_status.kill_signal = 0;
+
+  if (!arguments[1] || !arguments[2] || (arguments[3] && arguments[4])) {
+    fprintf(stderr, "usage: json FILE QUERY [NAME]\n");
+    return;
   }
 
-  // Search for matching background proces and remove it
-  struct process *current_background_process = program_status.background;
-  struct process *previous_background_process = NULL;
-  while (current_background_process->process_id != process_id) {
-    previous_background_process = current_background_process;
-    current_background_process = current_background_process->next;
+  struct json_document *document = load_json(arguments[1]);
+  if (!document)
+    return;
 
-    // process id not found
-    if (!current_background_process)
-      return false;
+  int *results = malloc(document->num_nodes * sizeof(int));
+  int num_results = query_json(document, 0, arguments[2], results, 0);
+  if (num_results == -1) {
+    fprintf(stderr, "json: %s: invalid query\n", arguments[2]);
+    free(results);
+    return;
   }
 
-  // Deleting the background process
-  if (program_status.background->process_id == process_id) {
-    program_status.background = program_status.background->next;
+  char **values = calloc(num_results + 1, sizeof(char *));
+  for (int i = 0; i < num_results; i++)
+    values[i] = json_value(document, results[i]);
+
+  if (arguments[3]) {
+    set_variable(arguments[3], values, num_results);
   } else {
-    previous_background_process->next = current_background_process->next;
+    for (int i = 0; i < num_results; i++)
+      printf("%s\n", values[i]);
+    fflush(stdout);
   }
-  
-  free(current_background_process);
-  return true;
+
+  for (int i = 0; i < num_results; i++)
+    free(values[i]);
+  free(values);
+  free(results);
+  program_status.exit_status = num_results > 0 ? SUCCESS : FAILURE;
 }
 
 /*
- * Function: write_integer
+ * Function: compile_regex
  * -----------------------------------------------------------------------------
- * A reentrant function that takes an integer as parameter and 
- *   print it to the terminal.
+ * Take an extended regular expression and regcomp flags as parameters.
+ * Return the compiled expression, compiling it only the first time: the
+ *   REGEX_CACHE_SIZE most recently used expressions are kept compiled.
+ * Returns NULL if the expression is invalid.
  */
-void write_integer(int num) {
+regex_t *compile_regex(const char *pattern, int flags) {
 
-  // Handle zero
-  if (num == 0) {
-    write(STDOUT_FILENO, "0", 1);
-    return;
+  struct regex_entry **link = &cached_regexes;
+  int num_entries = 0;
+  for (struct regex_entry *current = *link; current;
+       link = &current->next, current = *link, num_entries++) {
+    if (current->flags != flags || strcmp(current->pattern, pattern) != 0)
+      continue;
+    *link = current->next;
+    current->next = cached_regexes;
+    cached_regexes = current;
+    return &current->compiled;
   }
 
-  // Get number of digits
-  int num_digit = 0;
-  int dividend = num;
-  while (dividend > 0) {
-    dividend = (int) (dividend / 10);
-    num_digit += 1;
+  struct regex_entry *entry = calloc(1, sizeof(struct regex_entry));
+  int error = regcomp(&entry->compiled, pattern, flags);
+  if (error) {
+    char message[MAX_MESSAGE_LENGTH];
+    regerror(error, &entry->compiled, message, sizeof(message));
+    fprintf(stderr, "[[: %s: %s\n", pattern, message);
+    free(entry);
+    return NULL;
   }
+  entry->pattern = strdup(pattern);
+  entry->flags = flags;
+  entry->next = cached_regexes;
+  cached_regexes = entry;
+
+  // Drop the least recently used expression
+  if (num_entries == REGEX_CACHE_SIZE) {
+    for (link = &cached_regexes; (*link)->next; link = &(*link)->next)
+      ;
+    regfree(&(*link)->compiled);
+    free((*link)->pattern);
+    free(*link);
+    *link = NULL;
+  }
+  return &entry->compiled;
+}
+
+/*
+ * Function: match_regex
+ * -----------------------------------------------------------------------------
+ * Take a string and an extended regular expression as parameters.
+ * Match the string and set the array BASH_REMATCH to the matched text
+ *   followed by the text of each group, or to no elements if it does not
+ *   match.
+ * Returns SUCCESS if the string matches, FAILURE if it does not match or
+ *   the expression is invalid.
+ */
+int match_regex(const char *string, const char *pattern) {
+
+  int flags = REG_EXTENDED | (program_status.nocasematch ? REG_ICASE : 0);
+  regex_t *compiled = compile_regex(pattern, flags);
+  if (!compiled)
+    return FAILURE;
 
-  // Create a number string
-  char num_string[num_digit];
-  int index = num_digit - 1;
-  dividend = num;
-  while (index >= 0) {
-    num_string[index] = dividend - (int)(dividend / 10) * 10 + 48;
-    dividend = (int) (dividend / 10);
-    index--;
+  regmatch_t matches[MAX_REGEX_GROUPS];
+  size_t num_groups = compiled->re_nsub + 1 < MAX_REGEX_GROUPS ?
+                      compiled->re_nsub + 1 : MAX_REGEX_GROUPS;
+  if (regexec(compiled, string, num_groups, matches, 0) != 0) {
+    set_variable("BASH_REMATCH", NULL, 0);
+    return FAILURE;
   }
 
-  // Write to STDOUT
-  write(STDOUT_FILENO, num_string, num_digit);
+  char *groups[MAX_REGEX_GROUPS];
+  for (size_t i = 0; i < num_groups; i++) {
+    groups[i] = matches[i].rm_so == -1 ? strdup("") :
+                strndup(string + matches[i].rm_so,
+                        matches[i].rm_eo - matches[i].rm_so);
+  }
+  set_variable("BASH_REMATCH", groups, num_groups);
+  for (size_t i = 0; i < num_groups; i++)
+    free(groups[i]);
+  return SUCCESS;
 }
 
 /*
- * Function: redirect
+ * Function: test_condition
  * -----------------------------------------------------------------------------
- * Takes the user command and redirection mode as parameters.
- *   Redirect the input or output to the provided filename (if available)
- *     based on the redirection mode.
- * If the process is a background process and no filename is given, 
- *   then the input or output will be redirected to /dev/null
+ * Take a pointer to user_command as parameter:
+ *   [[ [!] STRING ]]          - STRING is not empty
+ *   [[ [!] -n|-z STRING ]]    - STRING is not empty or empty
+ *   [[ [!] STRING == PATTERN ]], also = and != - STRING matches the
+ *                                wildcard PATTERN
+ *   [[ [!] STRING =~ REGEX ]] - STRING matches the extended regular
+ *                               expression, see match_regex
+ * The condition is evaluated in the shell, so checks in a loop neither fork
+ *   nor compile the same expression again.
+ * Set the exit status to SUCCESS if the condition holds.
  */
-bool redirect(struct command *user_command, int mode) {
+void test_condition(struct command *user_command) {
 
-  // Get filename
-  char *filename;
-  if (mode == INPUT) {
-    filename = user_command->input_file;
-  } else {
-    filename = user_command->output_file;
+  char **arguments = user_command->arguments + 1;
+  int num_arguments = 0;
+  while (arguments[num_arguments])
+    num_arguments++;
+
+  program_status.kill_signal = 0;
+  program_status.exit_status = FAILURE;
+  if (num_arguments == 0 || strcmp(arguments[--num_arguments], "]]") != 0) {
+    fprintf(stderr, "[[: missing ]]\n");
+    return;
   }
 
-  // Handle missing files
-  if (!filename) {
-    if (user_command->background)
-      filename = "/dev/null";
-    else
-      return true;
+  bool negate = num_arguments > 1 && strcmp(arguments[0], "!") == 0;
+  if (negate) {
+    arguments++;
+    num_arguments--;
   }
 
-	// Get file name and open file
-  int file_descriptor;
-  char *mode_string;
-  if (mode == INPUT) {
-    file_descriptor = open(filename, O_RDONLY);
-    mode_string = "input";
+  int result;
+  int match_flags = program_status.nocasematch ? FNM_CASEFOLD : 0;
+  if (num_arguments == 1) {
+    result = arguments[0][0] ? SUCCESS : FAILURE;
+
+  } else if (num_arguments == 2 && strcmp(arguments[0], "-n") == 0) {
+    result = arguments[1][0] ? SUCCESS : FAILURE;
+
+  } else if (num_arguments == 2 && strcmp(arguments[0], "-z") == 0) {
+    result = arguments[1][0] ? FAILURE : SUCCESS;
+
+  } else if (num_arguments == 3 && (strcmp(arguments[1], "==") == 0 ||
+                                    strcmp(arguments[1], "=") == 0)) {
+    result = fnmatch(arguments[2], arguments[0], match_flags) == 0 ?
+             SUCCESS : FAILURE;
+
+  } else if (num_arguments == 3 && strcmp(arguments[1], "!=") == 0) {
+    result = fnmatch(arguments[2], arguments[0], match_flags) == 0 ?
+             FAILURE : SUCCESS;
+
+  } else if (num_arguments == 3 && strcmp(arguments[1], "=~") == 0) {
+    result = match_regex(arguments[0], arguments[2]);
 
   } else {
-    file_descriptor = open(filename, O_WRONLY | O_CREAT | O_TRUNC , 0644);
-    mode_string = "output";
+    fprintf(stderr, "[[: invalid condition\n");
+    return;
   }
 
-  // Handle file opening error
-	if (file_descriptor == -1) { 
-		printf("cannot open %s for %s\n", filename, mode_string);
-    fflush(stdout);
-		return false;
-	}
+  program_status.exit_status = negate ? !result : result;
+}
 
-	// Redirection to designated file
-  int result = dup2(file_descriptor, mode);
-	if (result == -1) { 
-		printf("redirection to %s failed\n", filename);
-    fflush(stdout);
+/*
+ * Function: start_coprocess
+ * -----------------------------------------------------------------------------
+ * Take a pointer to user_command as parameter:
+ *   coproc NAME cmd [args...]
+ *   coproc -c NAME
+ * Start cmd as a background job with its stdin and stdout connected to the
+ *   shell by pipes. NAME[0] is set to the descriptor reading its output and
+ *   NAME[1] to the descriptor writing its input, for use with "read -u" and
+ *   ">&${NAME[1]}", and NAME_PID to its process id.
+ * With -c, close the shell's ends of the pipes of coprocess NAME,
+ *   which gives the coprocess the end of its input.
+ */
+void start_coprocess(struct command *user_command) {
+
+  char **arguments = user_command->arguments;
+  program_status.exit_status = FAILURE;
+
+  if (arguments[1] && strcmp(arguments[1], "-c") == 0 && arguments[2]) {
+    struct variable *found = find_variable(arguments[2]);
+    if (found && found->num_values == 2) {
+      close(atoi(found->values[0]));
+      close(atoi(found->values[1]));
+      program_status.exit_status = SUCCESS;
+    }
+    return;
+  }
+
+  if (!arguments[1] || !arguments[2]) {
+    fprintf(stderr, "usage: coproc NAME cmd [args...] | coproc -c NAME\n");
+    return;
+  }
+
+  int input_pipe[2];
+  int output_pipe[2];
+  if (pipe2(input_pipe, O_CLOEXEC) == -1)
+    return;
+  if (pipe2(output_pipe, O_CLOEXEC) == -1) {
+    close(input_pipe[0]);
+    close(input_pipe[1]);
+    return;
+  }
+  set_pipe_size(input_pipe[1], program_status.pipe_size);
+  set_pipe_size(output_pipe[1], program_status.pipe_size);
+
+  pid_t spawn_pid = fork();
+  num_forks++;
+  switch (spawn_pid) {
+
+    case -1:
+      perror("fork() failed");
+      close(input_pipe[0]);
+      close(input_pipe[1]);
+      close(output_pipe[0]);
+      close(output_pipe[1]);
+      return;
+
+    case 0:
+      reset_trapped_signals();
+      sa_sigint.sa_handler = SIG_IGN;
+      sigaction(SIGINT, &sa_sigint, NULL);
+      sa_sigtstp.sa_handler = SIG_IGN;
+      sigaction(SIGTSTP, &sa_sigtstp, NULL);
+      sa_sigchld.sa_handler = SIG_DFL;
+      sigaction(SIGCHLD, &sa_sigchld, NULL);
+
+      dup2(input_pipe[0], STDIN_FILENO);
+      dup2(output_pipe[1], STDOUT_FILENO);
+      execvp(arguments[2], &arguments[2]);
+      perror(arguments[2]);
+      exit(FAILURE);
+
+    default:
+      close(input_pipe[0]);
+      close(output_pipe[1]);
+
+      char descriptors[2][16];
+      char *values[2] = {descriptors[0], descriptors[1]};
+      snprintf(descriptors[0], sizeof(descriptors[0]), "%d", output_pipe[0]);
+      snprintf(descriptors[1], sizeof(descriptors[1]), "%d", input_pipe[1]);
+      set_variable(arguments[1], values, 2);
+
+      char pid_name[MAX_VARIABLE_NAME + 8];
+      char pid_string[16];
+      char *pid_value = pid_string;
+      snprintf(pid_name, sizeof(pid_name), "%s_PID", arguments[1]);
+      snprintf(pid_string, sizeof(pid_string), "%d", spawn_pid);
+      set_variable(pid_name, &pid_value, 1);
+
+      push_background_process(spawn_pid, NULL);
+      printf("background pid is %d\n", spawn_pid);
+      fflush(stdout);
+      program_status.exit_status = SUCCESS;
+  }
+}
+
+/*
+ * Function: find_alias
+ * -----------------------------------------------------------------------------
+ * Takes an alias name as parameter.
+ * Returns the alias with that name, or NULL if it is not defined.
+ */
+struct alias *find_alias(const char *name) {
+
+  for (struct alias *current = shell_aliases; current;
+       current = current->next) {
+    if (strcmp(current->name, name) == 0)
+      return current;
+  }
+  return NULL;
+}
+
+/*
+ * Function: expand_alias
+ * -----------------------------------------------------------------------------
+ * Takes the words of a command line and the number of words.
+ * While the first word is an alias, splice its words in place of it.
+ * Each alias is expanded at most once per line: it is stamped with the
+ *   generation of the current line, so "alias ls=ls -F" does not recurse.
+ * Returns the new number of words.
+ */
+int expand_alias(char **tokens, int num_tokens) {
+
+  alias_generation++;
+
+  struct alias *found;
+  while ((found = find_alias(tokens[0])) &&
+         found->generation != alias_generation &&
+         num_tokens - 1 + found->num_tokens <= MAX_ARGS) {
+    found->generation = alias_generation;
+    memmove(tokens + found->num_tokens, tokens + 1,
+            (num_tokens - 1) * sizeof(char *));
+    memcpy(tokens, found->tokens, found->num_tokens * sizeof(char *));
+    num_tokens += found->num_tokens - 1;
+  }
+  return num_tokens;
+}
+
+/*
+ * Function: print_alias
+ * -----------------------------------------------------------------------------
+ * Takes an alias and print it as an alias command.
+ */
+void print_alias(struct alias *alias) {
+
+  printf("alias %s=", alias->name);
+  for (int i = 0; i < alias->num_tokens; i++)
+    printf(i ? " %s" : "%s", alias->tokens[i]);
+  printf("\n");
+  fflush(stdout);
+}
+
+/*
+ * Function: define_alias
+ * -----------------------------------------------------------------------------
+ * Take a pointer to user_command as parameter:
+ *   alias NAME=WORD [WORD...]   define NAME as the words
+ *   alias NAME                  print the alias NAME
+ *   alias                       print every alias
+ */
+void define_alias(struct command *user_command) {
+
+  char **arguments = user_command->arguments;
+  program_status.exit_status = SUCCESS;
+  program_status.kill_signal = 0;
+
+  // Print every alias
+  if (!arguments[1]) {
+    for (struct alias *current = shell_aliases; current;
+         current = current->next)
+      print_alias(current);
+    return;
+  }
+
+  char *equals = strchr(arguments[1], '=');
+
+  // Print one alias
+  if (!equals) {
+    struct alias *found = find_alias(arguments[1]);
+    if (found) {
+      print_alias(found);
+    } else {
+      fprintf(stderr, "alias: %s: not found\n", arguments[1]);
+      program_status.exit_status = FAILURE;
+    }
+    return;
+  }
+
+  // The words of the definition, the first one following the '='
+  char **words = arguments + 2;
+  int num_words = 0;
+  while (words[num_words])
+    num_words++;
+  if (equals[1]) {
+    words--;
+    num_words++;
+  }
+
+  if (equals == arguments[1] || num_words == 0) {
+    fprintf(stderr, "usage: alias NAME=WORD [WORD...]\n");
+    program_status.exit_status = FAILURE;
+    return;
+  }
+
+  *equals = '\0';
+  struct alias *found = find_alias(arguments[1]);
+  if (!found) {
+    found = calloc(1, sizeof(struct alias));
+    found->name = strdup(arguments[1]);
+    found->next = shell_aliases;
+    shell_aliases = found;
+  } else {
+    for (int i = 0; i < found->num_tokens; i++)
+      free(found->tokens[i]);
+    free(found->tokens);
+  }
+
+  found->tokens = calloc(num_words, sizeof(char *));
+  found->tokens[0] = strdup(equals[1] ? equals + 1 : words[0]);
+  for (int i = 1; i < num_words; i++)
+    found->tokens[i] = strdup(words[i]);
+  found->num_tokens = num_words;
+  *equals = '=';
+}
+
+/*
+ * Function: remove_alias
+ * -----------------------------------------------------------------------------
+ * Take a pointer to user_command as parameter:
+ *   unalias NAME...   remove the aliases
+ *   unalias -a        remove every alias
+ */
+void remove_alias(struct command *user_command) {
+
+  char **arguments = user_command->arguments;
+  bool remove_all = arguments[1] && strcmp(arguments[1], "-a") == 0;
+  program_status.exit_status = SUCCESS;
+  program_status.kill_signal = 0;
+
+  for (int i = 1; arguments[i]; i++) {
+    struct alias **link = &shell_aliases;
+    bool removed = false;
+    while (*link) {
+      struct alias *current = *link;
+      if (remove_all || strcmp(current->name, arguments[i]) == 0) {
+        *link = current->next;
+        for (int j = 0; j < current->num_tokens; j++)
+          free(current->tokens[j]);
+        free(current->tokens);
+        free(current->name);
+        free(current);
+        removed = true;
+      } else {
+        link = &current->next;
+      }
+    }
+
+    if (remove_all)
+      return;
+    if (!removed) {
+      fprintf(stderr, "unalias: %s: not found\n", arguments[i]);
+      program_status.exit_status = FAILURE;
+    }
+  }
+}
+
+/*
+ * Function: execute_command
+ * -----------------------------------------------------------------------------
+ * Take a pointer to user_command as parameter.
+ * Execute shell builtins, such as status, cd, and exit, in the foreground,
+ *   run other builtins in the shell or on the thread pool when possible and
+ *   create a new process and execute for other commands.
+ * Builtins are found through the builtin registry.
+ */
+void execute_command(struct command *user_command) {
+
+  const struct registry_entry *entry = 
+    lookup_builtin(user_command->arguments[0]);
+  const struct builtin *builtin = entry ? entry->builtin : NULL;
+  if (builtin && !builtin_supports(builtin, user_command->arguments))
+    builtin = NULL;
+  
+  if (assign_variable(user_command)) {
+    return;
+
+  } else if (entry && entry->shell_builtin) {
+    entry->shell_builtin->run(user_command);
+
+  } else if (builtin &&
+             !(builtin->flags & BUILTIN_FORKED) &&
+             !user_command->extra_output_files[0] &&
+             (!user_command->background ||
+              builtin->flags & BUILTIN_THREAD_SAFE)) {
+    if (user_command->background)
+      start_thread_job(builtin, user_command);
+    else
+      run_builtin(builtin, user_command);
+
+  } else {
+    fork_and_execute(user_command);
+  }
+}
+
+/*
+ * Function: change_directory
+ * -----------------------------------------------------------------------------
+ * Take a pointer to the user_command and change the current working directory.
+ * If there is no argument after cd, 
+ *   it will change the current working directory to the home directory.
+ * Otherwise, it will change it to the first argument after cd.
+ */
+void change_directory(struct command *user_command) {
+
+  char *path = user_command->arguments[1];
+
+  if (!path) {
+    path = getenv("HOME");
+  }
+
+  chdir(path);
+}
+
+/*
+ * Function: report_status
+ * -----------------------------------------------------------------------------
+ * Take a pointer to and report the exit status or terminating signal of 
+ *   the last foregound process.
+ */
+void report_status(void) {
+
+  if (program_status.kill_signal) {
+    write_message(STDOUT_FILENO, "terminated by signal %d\n",
+                  program_status.kill_signal);
+
+  } else {
+    write_message(STDOUT_FILENO, "exit value %d\n", program_status.exit_status);
+  }
+}
+
+/*
+ * Function: exit_and_cleanup
+ * -----------------------------------------------------------------------------
+ * Take a pointer to user_command as parameter, 
+ *   free all allocated memory and kill all child processes.
+ * Also kill and free the memory of all running background processes,
+ *   and cancel background builtins still running on the thread pool.
+ * The EXIT trap, if any, runs first.
+ */
+void exit_and_cleanup(struct command *user_command) {
+
+  reset_command(user_command, false);
+  run_trap(TRAP_EXIT);
+  flush_notifications();
+
+  while (program_status.background) {
+    if (program_status.background->thread_job)
+      program_status.background->thread_job->cancelled = true;
+    else
+      kill(program_status.background->process_id, SIGTERM);
+    pop_background_process(program_status.background->process_id);
+  }
+  print_line_profile();
+}
+
+/*
+ * Function: fork_and_execute
+ * -----------------------------------------------------------------------------
+ * Take a pointer to user_command as parameter, 
+ *   create a child process to execute the arguments
+ *   in the background or the foreground based on user input.
+ * Also update/add the foreground and background process to program_status.
+ */
+void fork_and_execute(struct command *user_command) {
+  
+  // Resolve the executable in the shell, so the PATH cache is kept
+  const char *path = find_builtin(user_command->arguments) ? NULL :
+                     resolve_command(user_command->arguments[0]);
+
+  // Background processes wait for a jobserver token
+  bool holds_token = user_command->background && jobserver.size > 0 &&
+                     acquire_job_token();
+
+  // int child_exit_method;
+  pid_t spwan_pid = fork();
+  num_forks++;
+
+  switch(spwan_pid) {
+
+    // Forking error
+    case -1:
+
+      perror("fork() failed\n");
+      exit(FAILURE);
+
+    // Child process
+    case 0:
+      run_child(user_command, path);
+
+    // Parent Process
+    default:
+
+      // Background process
+      if (user_command->background) {
+
+        // Adding background pid to program_status
+        push_background_process(spwan_pid, NULL)->holds_token = holds_token;
+        printf("background pid is %d\n", spwan_pid);
+        fflush(stdout);
+
+      // Foreground process
+      } else {
+
+        // Adding foreground pid to program_status
+        program_status.foreground = spwan_pid;
+
+        // Wait until the foreground process finishes
+        wait_for_foreground();
+      }
+  }
+}
+
+/*
+ * Function: run_child
+ * -----------------------------------------------------------------------------
+ * Take a pointer to user_command and the resolved executable (or NULL),
+ *   in a newly forked child process.
+ * Set up the signals and redirections of the child and run the command,
+ *   a builtin that runs after redirection or else the executable.
+ * Never returns.
+ */
+void run_child(struct command *user_command, const char *path) {
+
+  // Signals trapped by the shell are not trapped in its children
+  reset_trapped_signals();
+
+  // Only foreground process should listen for SIGINT
+  sa_sigint.sa_handler = user_command->background ? SIG_IGN : SIG_DFL;
+  sigaction(SIGINT, &sa_sigint, NULL);
+
+  // Both foreground and background processes should ignore SIGTSTP
+  sa_sigtstp.sa_handler = SIG_IGN;
+  sigaction(SIGTSTP, &sa_sigtstp, NULL);
+
+  // Children reap their own children, not through the shell's handler
+  sa_sigchld.sa_handler = SIG_DFL;
+  sigaction(SIGCHLD, &sa_sigchld, NULL);
+
+  if (!redirect(user_command, INPUT))
+    exit(FAILURE);
+  if (user_command->extra_output_files[0]) {
+    if (!redirect_multios(user_command))
+      exit(FAILURE);
+  } else if (!redirect(user_command, OUTPUT)) {
+    exit(FAILURE);
+  }
+
+  // Builtins that run in the child process after redirection
+  const struct builtin *builtin = find_builtin(user_command->arguments);
+  if (builtin) {
+    struct builtin_context context = {AT_FDCWD, STDIN_FILENO,
+                                      STDOUT_FILENO, NULL, environ,
+                                      get_shell_variable,
+                                      set_shell_variable};
+    exit(builtin->run(user_command->arguments, &context));
+  }
+  
+  if (path)
+    execv(path, user_command->arguments);
+  execvp(user_command->arguments[0], user_command->arguments);
+  perror(user_command->arguments[0]);
+  exit(FAILURE);
+}
+
+/*
+ * Function: handle_sigchld
+ * -----------------------------------------------------------------------------
+ * Listen for SIGCHLD signals returned by 
+ *   both the background and foreground processes,
+ *   and raised by pool threads when a background builtin finishes.
+ * Only records the signal; the children are reaped by reap_children
+ *   at the next safe point, so nothing unsafe runs in signal context.
+ */
+void handle_sigchld(int signal) {
+
+  pending_signals[SIGCHLD] = 1;
+  signals_pending = 1;
+}
+
+/*
+ * Function: handle_sigtstp
+ * -----------------------------------------------------------------------------
+ * Listen for SIGTSTP signals returned by the terminal.
+ * Only records the signal; foreground-only mode is toggled by
+ *   handle_pending_signals at the next safe point.
+ */
+void handle_sigtstp(int signal) {
+
+  pending_signals[SIGTSTP] = 1;
+  signals_pending = 1;
+}
+
+/*
+ * Function: handle_trapped_signal
+ * -----------------------------------------------------------------------------
+ * Listen for signals with a trap set.
+ * Only records the signal; the trap runs at the next safe point.
+ */
+void handle_trapped_signal(int signal) {
+
+  pending_signals[signal] = 1;
+  signals_pending = 1;
+}
+
+/*
+ * Function: handle_builtin_sigint
+ * -----------------------------------------------------------------------------
+ * Listen for SIGINT while a builtin runs in the foreground of the shell.
+ * Ask the builtin to stop, as the signal would stop a foreground child,
+ *   and record the signal for its trap if one is set.
+ */
+void handle_builtin_sigint(int signal) {
+
+  builtin_cancelled = true;
+  if (trap_commands[SIGINT]) {
+    pending_signals[signal] = 1;
+    signals_pending = 1;
+  }
+}
+
+/*
+ * Function: other_signals_pending
+ * -----------------------------------------------------------------------------
+ * Takes a signal number as parameter.
+ * Returns whether a signal other than that one is waiting to be handled.
+ */
+bool other_signals_pending(int signal) {
+
+  for (int other = 1; other < NSIG; other++) {
+    if (other != signal && pending_signals[other])
+      return true;
+  }
+  return false;
+}
+
+/*
+ * Function: handle_pending_signals
+ * -----------------------------------------------------------------------------
+ * Handle the signals recorded by the signal handlers, at a safe point
+ *   between commands or while waiting for the foreground process:
+ *   reap children, toggle foreground-only mode and run traps.
+ * The foreground-only mode message and the traps wait until
+ *   no foreground process runs, like the traps of other shells.
+ */
+void handle_pending_signals(void) {
+
+  while (signals_pending) {
+    signals_pending = 0;
+
+    for (int signal = 1; signal < NSIG; signal++) {
+      if (pending_signals[signal]) {
+        pending_signals[signal] = 0;
+        pending_traps[signal] = true;
+      }
+    }
+
+    if (pending_traps[SIGCHLD])
+      reap_children();
+
+    // Toggle foreground-only mode
+    if (pending_traps[SIGTSTP]) {
+      pending_traps[SIGTSTP] = false;
+      program_status.foreground_only = !program_status.foreground_only;
+      mode_message_pending = !mode_message_pending;
+    }
+  }
+
+  // Messages and traps wait until there is not a foreground process
+  if (program_status.foreground || running_trap)
+    return;
+
+  // Display the status fg-only mode.
+  if (mode_message_pending) {
+    mode_message_pending = false;
+    if (program_status.foreground_only) {
+      write_message(STDOUT_FILENO,
+                    "\nEntering foreground-only mode (& is now ignored)\n");
+    } else {
+      write_message(STDOUT_FILENO, "\nExiting foreground-only mode\n");
+    }
+  }
+
+  for (int signal = 1; signal < NSIG; signal++) {
+    if (pending_traps[signal]) {
+      pending_traps[signal] = false;
+      run_trap(signal);
+    }
+  }
+
+  if (error_pending) {
+    error_pending = false;
+    run_trap(TRAP_ERR);
+  }
+}
+
+/*
+ * Function: wait_for_foreground
+ * -----------------------------------------------------------------------------
+ * Wait until the foreground process in program_status has finished,
+ *   handling signals as they arrive.
+ * SIGCHLD is blocked between checking for pending signals and sigsuspend,
+ *   so a child finishing in between cannot be missed.
+ * In script mode, the upcoming commands are prepared first.
+ */
+void wait_for_foreground(void) {
+
+  sigset_t child_signal, previous_signals;
+  sigemptyset(&child_signal);
+  sigaddset(&child_signal, SIGCHLD);
+
+  // Prepare the next commands of a script while this one runs
+  if (script_mode)
+    prefetch_upcoming_commands();
+
+  while (program_status.foreground) {
+    sigprocmask(SIG_BLOCK, &child_signal, &previous_signals);
+    if (!signals_pending)
+      sigsuspend(&previous_signals);
+    sigprocmask(SIG_SETMASK, &previous_signals, NULL);
+    handle_pending_signals();
+  }
+}
+
+/*
+ * Function: reap_children
+ * -----------------------------------------------------------------------------
+ * Reap every finished child process and background builtin.
+ * Also, report and/or update  exit value or termination signals as well as
+ *   updating foreground/background processes in program_status.
+ */
+void reap_children(void) {
+
+  pid_t pid;
+  int exit_method;
+
+  while ((pid = waitpid(-1, &exit_method, WNOHANG)) > 0) {
+
+    // Background process
+    if (pop_background_process(pid)) {
+
+      // Report exiting background process
+      if (WIFEXITED(exit_method)) {
+        notify_completion("background pid %d is done: exit value %d\n",
+                          pid, WEXITSTATUS(exit_method));
+
+      // Exited by interruption
+      } else if (WIFSIGNALED(exit_method)) {
+        notify_completion("background pid %d is done: "
+                          "terminated by signal %d\n", pid,
+                          WTERMSIG(exit_method));
+      }
+
+    // Foreground process
+    } else {
+
+      // Normal exit
+      if (WIFEXITED(exit_method)) {
+        program_status.exit_status = WEXITSTATUS(exit_method);
+        program_status.kill_signal = 0;
+      }
+
+      // Exited by interruption
+      if (WIFSIGNALED(exit_method)) {
+        program_status.kill_signal = WTERMSIG(exit_method);
+        program_status.exit_status = 0;
+        report_status();
+      }
+
+      // Failed foreground commands run the ERR trap
+      if (program_status.exit_status != 0 || program_status.kill_signal)
+        error_pending = true;
+
+      program_status.foreground = 0;
+    }
+  }
+
+  // Background builtins finished on the thread pool
+  struct process *current_background_process = program_status.background;
+  while (current_background_process) {
+    struct process *next_background_process = current_background_process->next;
+    struct thread_job *job = current_background_process->thread_job;
+
+    if (job && __atomic_load_n(&job->finished, __ATOMIC_ACQUIRE)) {
+      // Cancelled jobs are reported like processes killed by SIGTERM
+      if (job->cancelled) {
+        notify_completion("background job %d is done: "
+                          "terminated by signal %d\n", job->job_id, SIGTERM);
+      } else {
+        notify_completion("background job %d is done: exit value %d\n",
+                          job->job_id, job->exit_value);
+      }
+
+      pop_background_process(current_background_process->process_id);
+      for (int i = 0; job->arguments[i]; i++)
+        free(job->arguments[i]);
+      free(job->arguments);
+      free(job);
+    }
+    current_background_process = next_background_process;
+  }
+}
+
+/*
+ * Function: run_trap
+ * -----------------------------------------------------------------------------
+ * Take a trap condition (a signal number, TRAP_EXIT or TRAP_ERR) and
+ *   run its trap command, if any, as if it was entered by the user.
+ * Traps do not nest, and the exit status of the last foreground command
+ *   is kept across the trap.
+ */
+void run_trap(int condition) {
+
+  if (!trap_commands[condition] || running_trap)
+    return;
+
+  int exit_status = program_status.exit_status;
+  int kill_signal = program_status.kill_signal;
+  running_trap = true;
+
+  // parse_command tokenizes in place
+  char input_line[MAX_COMMAND_LENGTH];
+  strncpy(input_line, trap_commands[condition], MAX_COMMAND_LENGTH - 1);
+  input_line[MAX_COMMAND_LENGTH - 1] = '\0';
+
+  struct command trap_command;
+  reset_command(&trap_command, true);
+  if (parse_command(input_line, &trap_command) == SUCCESS)
+    execute_command(&trap_command);
+  reset_command(&trap_command, false);
+
+  // Children of the trap itself do not run the CHLD trap
+  pending_traps[SIGCHLD] = false;
+  running_trap = false;
+  error_pending = false;
+  program_status.exit_status = exit_status;
+  program_status.kill_signal = kill_signal;
+}
+
+/*
+ * Function: parse_condition
+ * -----------------------------------------------------------------------------
+ * Take the name of a trap condition, such as EXIT, ERR, INT, SIGTERM or 15.
+ * Returns its signal number, TRAP_EXIT or TRAP_ERR.
+ * Returns -1 if it is unknown or cannot be trapped (SIGKILL, SIGSTOP and
+ *   SIGTSTP, which toggles foreground-only mode).
+ */
+int parse_condition(char *name) {
+
+  if (isdigit((unsigned char)*name)) {
+    int number = atoi(name);
+    if (number < 0 || number >= NSIG || number == SIGKILL ||
+        number == SIGSTOP || number == SIGTSTP)
+      return -1;
+    return number;
+  }
+
+  if (strncmp(name, "SIG", 3) == 0)
+    name += 3;
+  for (int i = 0; signal_names[i].name; i++) {
+    if (strcmp(name, signal_names[i].name) == 0)
+      return signal_names[i].number;
+  }
+  return -1;
+}
+
+/*
+ * Function: set_trap
+ * -----------------------------------------------------------------------------
+ * Take a pointer to user_command as parameter:
+ *   trap CMD [args...] CONDITION   run CMD when CONDITION occurs
+ *   trap - CONDITION               remove the trap
+ *   trap                           list the traps
+ * A trap on a signal runs at the next safe point after the signal arrives,
+ *   EXIT runs when the shell exits, and ERR after a foreground command fails.
+ */
+void set_trap(struct command *user_command) {
+
+  char **arguments = user_command->arguments;
+  program_status.exit_status = SUCCESS;
+  program_status.kill_signal = 0;
+
+  // List traps
+  if (!arguments[1]) {
+    for (int i = 0; signal_names[i].name; i++) {
+      char *command = trap_commands[signal_names[i].number];
+      if (command)
+        printf("trap %s %s\n", command, signal_names[i].name);
+    }
+    fflush(stdout);
+    return;
+  }
+
+  int last = 1;
+  while (arguments[last + 1])
+    last++;
+
+  int condition = parse_condition(arguments[last]);
+  if (last < 2 || condition == -1) {
+    fprintf(stderr, "usage: trap CMD [args...] CONDITION | trap - CONDITION\n");
+    program_status.exit_status = FAILURE;
+    return;
+  }
+
+  free(trap_commands[condition]);
+  trap_commands[condition] = NULL;
+
+  // Join the command back into a line for run_trap
+  bool reset = last == 2 && strcmp(arguments[1], "-") == 0;
+  if (!reset) {
+    size_t length = 0;
+    for (int i = 1; i < last; i++)
+      length += strlen(arguments[i]) + 1;
+    trap_commands[condition] = malloc(length);
+    trap_commands[condition][0] = '\0';
+    for (int i = 1; i < last; i++) {
+      if (i > 1)
+        strcat(trap_commands[condition], " ");
+      strcat(trap_commands[condition], arguments[i]);
+    }
+  }
+
+  // SIGCHLD is always caught, EXIT and ERR are not signals
+  if (condition == TRAP_EXIT || condition == TRAP_ERR || condition == SIGCHLD)
+    return;
+
+  struct sigaction action = {0};
+  sigfillset(&action.sa_mask);
+  if (reset)
+    action.sa_handler = condition == SIGINT ? SIG_IGN : SIG_DFL;
+  else
+    action.sa_handler = handle_trapped_signal;
+  sigaction(condition, &action, NULL);
+}
+
+/*
+ * Function: reset_trapped_signals
+ * -----------------------------------------------------------------------------
+ * Restore the default action of every trapped signal in a new child process.
+ */
+void reset_trapped_signals(void) {
+
+  struct sigaction action = {0};
+  action.sa_handler = SIG_DFL;
+  for (int signal = 1; signal < NSIG; signal++) {
+    if (trap_commands[signal] && signal != SIGCHLD)
+      sigaction(signal, &action, NULL);
+  }
+}
+
+/*
+ * Function: clear_path_cache
+ * -----------------------------------------------------------------------------
+ * Forget every executable remembered by the PATH cache.
+ */
+void clear_path_cache(void) {
+
+  for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+    while (path_cache[i]) {
+      struct path_entry *next = path_cache[i]->next;
+      free(path_cache[i]->name);
+      free(path_cache[i]->path);
+      free(path_cache[i]);
+      path_cache[i] = next;
+    }
+  }
+}
+
+/*
+ * Function: search_path
+ * -----------------------------------------------------------------------------
+ * Takes the value of PATH, a command name and a buffer of PATH_MAX bytes.
+ * Search the directories of PATH in turn for an executable regular file
+ *   named name, storing its path in the buffer.
+ * Returns true if one is found.
+ */
+bool search_path(const char *path_variable, const char *name, char *path) {
+
+  const char *directory = path_variable;
+  while (true) {
+    const char *separator = strchrnul(directory, ':');
+    int length = snprintf(path, PATH_MAX, "%.*s/%s",
+                          (int)(separator - directory), directory, name);
+    struct stat file_status;
+    if (separator > directory && length < PATH_MAX &&
+        stat(path, &file_status) == 0 && S_ISREG(file_status.st_mode) &&
+        access(path, X_OK) == 0)
+      return true;
+
+    if (!*separator)
+      return false;
+    directory = separator + 1;
+  }
+}
+
+/*
+ * Function: resolve_command
+ * -----------------------------------------------------------------------------
+ * Takes a command name as parameter.
+ * Search PATH for the executable of the command, remembering the result in
+ *   the PATH cache. The cache is cleared whenever PATH changes.
+ * Returns the path of the executable, or NULL if the name contains a slash
+ *   or is not found (then execvp reports the error as usual).
+ */
+const char *resolve_command(const char *name) {
+
+  const char *path_variable = getenv("PATH");
+  if (!path_variable || strchr(name, '/') || !name[0])
+    return NULL;
+
+  if (!cached_path_variable || strcmp(cached_path_variable, path_variable)) {
+    clear_path_cache();
+    free(cached_path_variable);
+    cached_path_variable = strdup(path_variable);
+  }
+
+  unsigned long bucket = hash_name(name, 0) % PATH_CACHE_SIZE;
+  for (struct path_entry *current = path_cache[bucket]; current;
+       current = current->next) {
+    if (strcmp(current->name, name) == 0)
+      return current->path;
+  }
+
+  char candidate[PATH_MAX];
+  if (!search_path(path_variable, name, candidate))
+    return NULL;
+
+  struct path_entry *entry = malloc(sizeof(struct path_entry));
+  entry->name = strdup(name);
+  entry->path = strdup(candidate);
+  entry->next = path_cache[bucket];
+  path_cache[bucket] = entry;
+  return entry->path;
+}
+
+/*
+ * Function: hash_commands
+ * -----------------------------------------------------------------------------
+ * Take a pointer to user_command as parameter:
+ *   hash           list the PATH cache
+ *   hash -r        clear the PATH cache
+ *   hash NAME...   resolve the commands and remember them
+ */
+void hash_commands(struct command *user_command) {
+
+  char **arguments = user_command->arguments;
+  program_status.exit_status = SUCCESS;
+  program_status.kill_signal = 0;
+
+  if (!arguments[1]) {
+    for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+      for (struct path_entry *current = path_cache[i]; current;
+           current = current->next)
+        printf("%s\t%s\n", current->name, current->path);
+    }
+    fflush(stdout);
+    return;
+  }
+
+  if (strcmp(arguments[1], "-r") == 0) {
+    clear_path_cache();
+    return;
+  }
+
+  for (int i = 1; arguments[i]; i++) {
+    if (!resolve_command(arguments[i])) {
+      fprintf(stderr, "hash: %s: not found\n", arguments[i]);
+      program_status.exit_status = FAILURE;
+    }
+  }
+}
+
+/*
+ * Function: prefetch_upcoming_commands
+ * -----------------------------------------------------------------------------
+ * Prepare the next LOOKAHEAD_LINES commands of a script that are already
+ *   buffered by the input parser, while the foreground command runs:
+ *   look up their executables along PATH, so the directories are in the
+ *   kernel's caches, and ask the kernel to read ahead their input files
+ *   (posix_fadvise WILLNEED).
+ * Only read-only work runs ahead: nothing is read from the input (a command
+ *   may read it), words with variables are skipped because earlier commands
+ *   may still change them, and the PATH cache is left alone because earlier
+ *   commands may still install an executable earlier in PATH.
+ */
+void prefetch_upcoming_commands(void) {
+
+  char *scan = input_parser.buffer + input_parser.start;
+  char *end = input_parser.buffer + input_parser.end;
+  const char *path_variable = getenv("PATH");
+
+  for (int num_lines = 0; num_lines < LOOKAHEAD_LINES && scan < end;
+       num_lines++) {
+    char *newline = memchr(scan, '\n', end - scan);
+    if (!newline)
+      break;
+
+    char line[MAX_COMMAND_LENGTH + 1];
+    memcpy(line, scan, newline - scan);
+    line[newline - scan] = '\0';
+    scan = newline + 1;
+
+    char *save_ptr;
+    char *token = strtok_r(line, " ", &save_ptr);
+    if (!token || token[0] == '#')
+      continue;
+
+    // The executable of the command
+    char path[PATH_MAX];
+    if (path_variable && !strchr(token, '$') && !strchr(token, '=') &&
+        !strchr(token, '/') && !find_alias(token) && !lookup_builtin(token))
+      search_path(path_variable, token, path);
+
+    // Its input file
+    while ((token = strtok_r(NULL, " ", &save_ptr))) {
+      if (strcmp(token, "<") != 0)
+        continue;
+      token = strtok_r(NULL, " ", &save_ptr);
+      if (!token || strchr(token, '$'))
+        break;
+
+      // Opening a FIFO or a device is not free of side effects
+      struct stat file_status;
+      if (stat(token, &file_status) == -1 || !S_ISREG(file_status.st_mode))
+        continue;
+      int file_descriptor = open(token, O_RDONLY | O_CLOEXEC);
+      if (file_descriptor != -1) {
+        posix_fadvise(file_descriptor, 0, 0, POSIX_FADV_WILLNEED);
+        close(file_descriptor);
+      }
+    }
+  }
+}
+
+/*
+ * Function: canonical_path
+ * -----------------------------------------------------------------------------
+ * Takes a path and a buffer of PATH_MAX characters.
+ * Store the absolute path without symbolic links of the file, or of its
+ *   directory followed by its name when the file does not exist yet.
+ * Returns false if neither can be resolved.
+ */
+bool canonical_path(const char *path, char *canonical) {
+
+  if (realpath(path, canonical))
+    return true;
+
+  char directory[PATH_MAX];
+  snprintf(directory, sizeof(directory), "%s", path);
+  char *slash = strrchr(directory, '/');
+  const char *name = slash ? path + (slash - directory) + 1 : path;
+  if (!slash)
+    strcpy(directory, ".");
+  else if (slash == directory)
+    slash[1] = '\0';
+  else
+    *slash = '\0';
+
+  char resolved[PATH_MAX];
+  if (!*name || !realpath(directory, resolved))
+    return false;
+  return snprintf(canonical, PATH_MAX, "%s/%s", strcmp(resolved, "/") ?
+                  resolved : "", name) < PATH_MAX;
+}
+
+/*
+ * Function: parallel_candidate
+ * -----------------------------------------------------------------------------
+ * Takes a parsed command of a block, and store the canonical paths of its
+ *   input and output files.
+ * Returns true only if everything the command touches is known:
+ *   an executable found through PATH (no builtin), plain flags as its only
+ *   arguments, a regular file as input (so it does not read the script)
+ *   and at most one output file.
+ * A plain flag is one letter or digit (-n) or a long name without a value
+ *   (--count): any other word, including grouped or valued options such as
+ *   -oFILE or --output=FILE, could name a file.
+ */
+bool parallel_candidate(struct parallel_command *candidate) {
+
+  struct command *command = &candidate->command;
+  if (command->background || command->extra_output_files[0] ||
+      command->input_descriptor != -1 || command->output_descriptor != -1 ||
+      !command->input_file)
+    return false;
+
+  if (lookup_builtin(command->arguments[0]) ||
+      !resolve_command(command->arguments[0]))
+    return false;
+  for (int i = 1; command->arguments[i]; i++) {
+    char *argument = command->arguments[i];
+    bool short_flag = argument[0] == '-' && isalnum(argument[1]) &&
+                      !argument[2];
+    bool long_flag = strncmp(argument, "--", 2) == 0 &&
+                     isalpha(argument[2]) && !strchr(argument, '=');
+    if (!short_flag && !long_flag)
+      return false;
+  }
+
+  struct stat file_status;
+  if (stat(command->input_file, &file_status) == -1 ||
+      !S_ISREG(file_status.st_mode) ||
+      !canonical_path(command->input_file, candidate->input))
+    return false;
+
+  candidate->output[0] = '\0';
+  return !command->output_file ||
+         canonical_path(command->output_file, candidate->output);
+}
+
+/*
+ * Function: parallel_conflict
+ * -----------------------------------------------------------------------------
+ * Takes a block of commands and the index of its newest command.
+ * Returns true if the newest command writes a file another command of the
+ *   block reads or writes, or reads a file another one writes.
+ */
+bool parallel_conflict(struct parallel_command *block, int newest) {
+
+  struct parallel_command *candidate = &block[newest];
+  for (int i = 0; i < newest; i++) {
+    if (block[i].output[0] &&
+        (strcmp(block[i].output, candidate->input) == 0 ||
+         strcmp(block[i].output, candidate->output) == 0))
+      return true;
+    if (candidate->output[0] &&
+        strcmp(candidate->output, block[i].input) == 0)
+      return true;
+  }
+  return false;
+}
+
+/*
+ * Function: emit_captured_output
+ * -----------------------------------------------------------------------------
+ * Takes a memory file holding captured output and a file descriptor.
+ * Copy the captured output to the file descriptor and close the memory file.
+ */
+void emit_captured_output(int capture_fd, int file_descriptor) {
+
+  char buffer[READ_CHUNK_SIZE * 8];
+  ssize_t num_bytes;
+  lseek(capture_fd, 0, SEEK_SET);
+  while ((num_bytes = read(capture_fd, buffer, sizeof(buffer))) > 0)
+    write_all(file_descriptor, buffer, num_bytes);
+  close(capture_fd);
+}
+
+/*
+ * Function: run_parallel_block
+ * -----------------------------------------------------------------------------
+ * Take a pointer to the user_command just read, with set -o autoparallel
+ *   in a script.
+ * Collect the following buffered lines into a block for as long as each
+ *   command is a parallel_candidate without a parallel_conflict, and run
+ *   the whole block concurrently. The stdout and stderr of every command
+ *   are captured and written, along with the prompts, in script order once
+ *   the command and all the ones before it have finished, so the output
+ *   and the final status match running them in turn (stderr follows stdout
+ *   per command). Any doubt, including an ERR trap, falls back to serial.
+ * With a jobserver, the block only grows while a token is free for each
+ *   command after the first, and lines expanding $EPOCHSECONDS or
+ *   $EPOCHREALTIME, which would be expanded early, end the block.
+ * Returns false if the command should run on its own as usual.
+ */
+bool run_parallel_block(struct command *user_command) {
+
+  if (!program_status.autoparallel || !script_mode ||
+      trap_commands[TRAP_ERR])
+    return false;
+
+  struct parallel_command *block = calloc(MAX_PARALLEL_COMMANDS,
+                                          sizeof(struct parallel_command));
+  block[0].command = *user_command;
+  if (!parallel_candidate(&block[0])) {
+    free(block);
+    return false;
+  }
+
+  // Take the following lines as long as they can join the block
+  int num_commands = 1;
+  while (num_commands < MAX_PARALLEL_COMMANDS && !input_parser.discarding) {
+    char *scan = input_parser.buffer + input_parser.start;
+    char *newline = memchr(scan, '\n', input_parser.end - input_parser.start);
+    if (!newline)
+      break;
+
+    char line[MAX_COMMAND_LENGTH + 1];
+    memcpy(line, scan, newline - scan);
+    line[newline - scan] = '\0';
+
+    // The line is expanded now, too early for the time variables
+    if (strstr(line, "$EPOCHSECONDS") || strstr(line, "$EPOCHREALTIME"))
+      break;
+
+    // Every command after the first runs on a jobserver token
+    struct parallel_command *next = &block[num_commands];
+    reset_command(&next->command, true);
+    if (parse_command(line, &next->command) != SUCCESS ||
+        !parallel_candidate(next) || parallel_conflict(block, num_commands) ||
+        (jobserver.size > 0 && !try_job_token())) {
+      reset_command(&next->command, false);
+      break;
+    }
+    next_line(&input_parser);
+    num_commands++;
+  }
+
+  if (num_commands == 1) {
+    free(block);
+    return false;
+  }
+
+  // The block owns the first command now
+  reset_command(user_command, true);
+
+  for (int i = 0; i < num_commands; i++) {
+    struct parallel_command *current = &block[i];
+    const char *path = resolve_command(current->command.arguments[0]);
+    current->output_fd = memfd_create("smallsh-stdout", MFD_CLOEXEC);
+    current->error_fd = memfd_create("smallsh-stderr", MFD_CLOEXEC);
+    if (current->output_fd == -1 || current->error_fd == -1) {
+      perror("memfd_create");
+      current->process_id = -1;
+      continue;
+    }
+
+    current->process_id = fork();
+    num_forks++;
+    if (current->process_id == 0) {
+      dup2(current->output_fd, STDOUT_FILENO);
+      dup2(current->error_fd, STDERR_FILENO);
+      run_child(&current->command, path);
+    }
+  }
+
+  // Finish the commands in script order
+  for (int i = 0; i < num_commands; i++) {
+    struct parallel_command *current = &block[i];
+    int exit_method = 0;
+    if (current->process_id > 0) {
+      while (waitpid(current->process_id, &exit_method, 0) == -1 &&
+             errno == EINTR)
+        continue;
+    }
+    if (i > 0 && jobserver.size > 0)
+      release_job_token();
+
+    if (i > 0) {
+      printf(": ");
+      fflush(stdout);
+    }
+    emit_captured_output(current->output_fd, STDOUT_FILENO);
+    emit_captured_output(current->error_fd, STDERR_FILENO);
+
+    if (current->process_id == -1) {
+      program_status.exit_status = FAILURE;
+      program_status.kill_signal = 0;
+    } else if (WIFSIGNALED(exit_method)) {
+      program_status.kill_signal = WTERMSIG(exit_method);
+      program_status.exit_status = 0;
+      report_status();
+    } else {
+      program_status.exit_status = WEXITSTATUS(exit_method);
+      program_status.kill_signal = 0;
+    }
+    reset_command(&current->command, false);
+  }
+
+  free(block);
+  return true;
+}
+
+/*
+ * Function: profile_line
+ * -----------------------------------------------------------------------------
+ * Return the profile of the line line_number, growing the table as needed.
+ */
+struct line_profile *profile_line(int line_number) {
+
+  if (line_number >= profiler.num_lines) {
+    int num_lines = profiler.num_lines ? profiler.num_lines : 64;
+    while (num_lines <= line_number)
+      num_lines *= 2;
+    profiler.lines = realloc(profiler.lines,
+                             num_lines * sizeof(struct line_profile));
+    memset(profiler.lines + profiler.num_lines, 0,
+           (num_lines - profiler.num_lines) * sizeof(struct line_profile));
+    profiler.num_lines = num_lines;
+  }
+  return &profiler.lines[line_number];
+}
+
+/*
+ * Function: start_profile_sample
+ * -----------------------------------------------------------------------------
+ * Take the counters before a command of a profiled script runs.
+ */
+void start_profile_sample(struct profile_sample *sample) {
+
+  if (!profiler.enabled)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &sample->wall);
+  getrusage(RUSAGE_SELF, &sample->shell);
+  getrusage(RUSAGE_CHILDREN, &sample->children);
+  sample->num_forks = num_forks;
+}
+
+/*
+ * Function: record_profile_sample
+ * -----------------------------------------------------------------------------
+ * Charge the time, CPU time and forks since sample to the current line.
+ * CPU time of children is only known once they are reaped, so the CPU time of
+ *   a background process is charged to the line running when it is reaped.
+ */
+void record_profile_sample(struct profile_sample *sample) {
+
+  if (!profiler.enabled)
+    return;
+
+  struct timespec wall;
+  struct rusage shell, children;
+  clock_gettime(CLOCK_MONOTONIC, &wall);
+  getrusage(RUSAGE_SELF, &shell);
+  getrusage(RUSAGE_CHILDREN, &children);
+
+  struct line_profile *line = profile_line(profiler.current_line);
+  line->count++;
+  line->wall_time += (wall.tv_sec - sample->wall.tv_sec) +
+                     (wall.tv_nsec - sample->wall.tv_nsec) / 1e9;
+  line->shell_time +=
+    (shell.ru_utime.tv_sec - sample->shell.ru_utime.tv_sec) +
+    (shell.ru_stime.tv_sec - sample->shell.ru_stime.tv_sec) +
+    (shell.ru_utime.tv_usec - sample->shell.ru_utime.tv_usec) / 1e6 +
+    (shell.ru_stime.tv_usec - sample->shell.ru_stime.tv_usec) / 1e6;
+  line->child_time +=
+    (children.ru_utime.tv_sec - sample->children.ru_utime.tv_sec) +
+    (children.ru_stime.tv_sec - sample->children.ru_stime.tv_sec) +
+    (children.ru_utime.tv_usec - sample->children.ru_utime.tv_usec) / 1e6 +
+    (children.ru_stime.tv_usec - sample->children.ru_stime.tv_usec) / 1e6;
+  line->num_forks += num_forks - sample->num_forks;
+}
+
+/*
+ * Function: compare_line_profiles
+ * -----------------------------------------------------------------------------
+ * Order line numbers by the wall time of their lines, longest first.
+ */
+int compare_line_profiles(const void *first, const void *second) {
+
+  double first_time = profiler.lines[*(const int *) first].wall_time;
+  double second_time = profiler.lines[*(const int *) second].wall_time;
+  return (first_time < second_time) - (first_time > second_time);
+}
+
+/*
+ * Function: print_line_profile
+ * -----------------------------------------------------------------------------
+ * Print the lines of a profiled script to stderr, costliest first.
+ */
+void print_line_profile(void) {
+
+  if (!profiler.enabled)
+    return;
+
+  int *order = malloc((profiler.num_lines + 1) * sizeof(int));
+  int num_ran = 0;
+  for (int i = 0; i < profiler.num_lines; i++)
+    if (profiler.lines[i].count > 0)
+      order[num_ran++] = i;
+  qsort(order, num_ran, sizeof(int), compare_line_profiles);
+
+  fprintf(stderr, "%6s %8s %11s %11s %11s %6s  %s\n",
+          "line", "count", "wall ms", "shell ms", "child ms", "forks", "source");
+  for (int i = 0; i < num_ran; i++) {
+    struct line_profile *line = &profiler.lines[order[i]];
+    fprintf(stderr, "%6d %8ld %11.3f %11.3f %11.3f %6ld  %s\n",
+            order[i], line->count, line->wall_time * 1e3,
+            line->shell_time * 1e3, line->child_time * 1e3, line->num_forks,
+            line->text ? line->text : "");
+  }
+  fflush(stderr);
+
+  for (int i = 0; i < profiler.num_lines; i++)
+    free(profiler.lines[i].text);
+  free(profiler.lines);
+  free(order);
+  profiler.lines = NULL;
+  profiler.num_lines = 0;
+}
+
+/*
+ * Function: start_jobserver
+ * -----------------------------------------------------------------------------
+ * Takes the number of job slots as parameter.
+ * Create the token pipe of a GNU make compatible jobserver holding size
+ *   tokens and advertise it to children in MAKEFLAGS (--jobserver-auth=R,W),
+ *   so make, ninja and cargo run by the shell share the same slots as the
+ *   background jobs and pfor iterations of the shell.
+ * Returns false if the pipe cannot be created.
+ */
+bool start_jobserver(int size) {
+
+  stop_jobserver();
+
+  int token_pipe[2];
+  if (pipe(token_pipe) == -1)
+    return false;
+
+  // A separate open file description of the read end can be non-blocking
+  // without changing the one children block on
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", token_pipe[0]);
+  jobserver.try_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (jobserver.try_fd == -1) {
+    close(token_pipe[0]);
+    close(token_pipe[1]);
+    return false;
+  }
+
+  jobserver.read_fd = token_pipe[0];
+  jobserver.write_fd = token_pipe[1];
+  jobserver.size = size;
+  for (int i = 0; i < size; i++)
+    release_job_token();
+
+  char *makeflags = getenv("MAKEFLAGS");
+  jobserver.saved_makeflags = makeflags ? strdup(makeflags) : NULL;
+  char value[MAX_COMMAND_LENGTH];
+  snprintf(value, sizeof(value), "%s --jobserver-auth=%d,%d",
+           makeflags ? makeflags : "", jobserver.read_fd, jobserver.write_fd);
+  setenv("MAKEFLAGS", value, 1);
+  return true;
+}
+
+/*
+ * Function: stop_jobserver
+ * -----------------------------------------------------------------------------
+ * Close the jobserver, if any, and restore MAKEFLAGS.
+ * Running jobs keep running; their tokens are forgotten.
+ */
+void stop_jobserver(void) {
+
+  if (jobserver.size == 0)
+    return;
+
+  for (struct process *current = program_status.background; current;
+       current = current->next)
+    current->holds_token = false;
+
+  close(jobserver.read_fd);
+  close(jobserver.write_fd);
+  close(jobserver.try_fd);
+  jobserver.read_fd = jobserver.write_fd = jobserver.try_fd = -1;
+  jobserver.size = 0;
+
+  if (jobserver.saved_makeflags)
+    setenv("MAKEFLAGS", jobserver.saved_makeflags, 1);
+  else
+    unsetenv("MAKEFLAGS");
+  free(jobserver.saved_makeflags);
+  jobserver.saved_makeflags = NULL;
+}
+
+/*
+ * Function: try_job_token
+ * -----------------------------------------------------------------------------
+ * Take a jobserver token if one is free, without waiting.
+ * Returns true if a token was taken.
+ */
+bool try_job_token(void) {
+
+  char token;
+  ssize_t num_bytes;
+  do {
+    num_bytes = read(jobserver.try_fd, &token, 1);
+  } while (num_bytes == -1 && errno == EINTR);
+  return num_bytes == 1;
+}
+
+/*
+ * Function: acquire_job_token
+ * -----------------------------------------------------------------------------
+ * Take a jobserver token, waiting until one is returned.
+ * SIGCHLD is only unblocked inside ppoll, so a job finishing (and returning
+ *   its token when it is reaped) always wakes the wait up. Only children
+ *   are reaped here; other signals are handled by the main loop.
+ * Returns true once a token was taken, false if there is no jobserver.
+ */
+bool acquire_job_token(void) {
+
+  sigset_t child_signal, previous_signals;
+  sigemptyset(&child_signal);
+  sigaddset(&child_signal, SIGCHLD);
+
+  while (jobserver.size > 0) {
+    if (try_job_token())
+      return true;
+
+    // Any signal ends the wait with EINTR
+    struct pollfd token_poll = {jobserver.try_fd, POLLIN, 0};
+    sigprocmask(SIG_BLOCK, &child_signal, &previous_signals);
+    if (!pending_signals[SIGCHLD])
+      ppoll(&token_poll, 1, NULL, &previous_signals);
+    sigprocmask(SIG_SETMASK, &previous_signals, NULL);
+
+    // Finished jobs return their tokens when reaped. The CHLD trap and
+    // every other signal are left to the main loop.
+    if (pending_signals[SIGCHLD]) {
+      pending_signals[SIGCHLD] = 0;
+      pending_traps[SIGCHLD] = true;
+      reap_children();
+    }
+  }
+  return false;
+}
+
+/*
+ * Function: release_job_token
+ * -----------------------------------------------------------------------------
+ * Return a jobserver token to the pipe.
+ */
+void release_job_token(void) {
+
+  if (jobserver.size > 0)
+    write_all(jobserver.write_fd, "+", 1);
+}
+
+/*
+ * Function: push_background_process
+ * -----------------------------------------------------------------------------
+ * Takes a background process pid and its pool job (if any) as parameters.
+ * Create a process node with the provided pid and 
+ *   add the node to the end of the background process linked list.
+ * Returns the new node.
+ */
+struct process *push_background_process(pid_t process_id,
+                                        struct thread_job *thread_job) {
+
+  // Create new node
+  struct process *new_background_process = (struct process *)
+                                           malloc(sizeof(struct process));
+  new_background_process->process_id = process_id;
+  new_background_process->thread_job = thread_job;
+  new_background_process->holds_token = false;
+  new_background_process->next = NULL;
+
+  // Add node to head if not exist
+  if (!program_status.background) {
+    program_status.background = new_background_process;
+    return new_background_process;
+  }
+
+  // Add node to the last location of the linked list
+  struct process *current_background_process = program_status.background;
+  while (current_background_process->next) {
+    current_background_process = current_background_process->next;
+  }
+
+  current_background_process->next = new_background_process;
+  return new_background_process;
+}
+
+/*
+ * Function: pop_background_process
+ * -----------------------------------------------------------------------------
+ * Takes a process pid as parameter.
+ * Remove/free the node from the background process linked list if available,
+ *   returning its jobserver token.
+ * Return true if the node has been removed from the background processes.
+ * Return false if there is no background processes matching the provided pid.
+ */
+bool pop_background_process(pid_t process_id) {
+
+  // No background processes currently
+  if (!program_status.background) {
+    return false;
+  }
+
+  // Search for matching background proces and remove it
+  struct process *current_background_process = program_status.background;
+  struct process *previous_background_process = NULL;
+  while (current_background_process->process_id != process_id) {
+    previous_background_process = current_background_process;
+    current_background_process = current_background_process->next;
+
+    // process id not found
+    if (!current_background_process)
+      return false;
+  }
+
+  // Deleting the background process
+  if (program_status.background->process_id == process_id) {
+    program_status.background = program_status.background->next;
+  } else {
+    previous_background_process->next = current_background_process->next;
+  }
+  
+  if (current_background_process->holds_token)
+    release_job_token();
+  free(current_background_process);
+  return true;
+}
+
+/*
+ * Function: format_integer
+ * -----------------------------------------------------------------------------
+ * A reentrant function that takes a buffer, its size and an integer.
+ * Render the integer in decimal at the start of the buffer, two digits at
+ *   a time from a table. Negative numbers, including LONG_MIN, are handled
+ *   through their unsigned magnitude.
+ * Returns the number of characters written, 0 if the buffer is too small.
+ */
+size_t format_integer(char *buffer, size_t size, long num) {
+
+  static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+
+  char digits[24];
+  char *current = digits + sizeof(digits);
+  unsigned long magnitude = num < 0 ? 0UL - (unsigned long)num : 
+                                      (unsigned long)num;
+
+  while (magnitude >= 100) {
+    unsigned long pair = (magnitude % 100) * 2;
+    magnitude /= 100;
+    *--current = digit_pairs[pair + 1];
+    *--current = digit_pairs[pair];
+  }
+  if (magnitude >= 10) {
+    *--current = digit_pairs[magnitude * 2 + 1];
+    *--current = digit_pairs[magnitude * 2];
+  } else {
+    *--current = '0' + magnitude;
+  }
+  if (num < 0)
+    *--current = '-';
+
+  size_t length = digits + sizeof(digits) - current;
+  if (length > size)
+    return 0;
+  memcpy(buffer, current, length);
+  return length;
+}
+
+/*
+ * Function: format_message
+ * -----------------------------------------------------------------------------
+ * A reentrant function that takes a buffer, its size, a format and arguments.
+ * Render the message into the buffer, truncating it to the size.
+ * The format understands %d (int), %ld (long), %s and %%.
+ * Returns the length of the message.
+ */
+size_t format_message(char *message, size_t size, const char *format,
+                      va_list arguments) {
+
+  size_t length = 0;
+  for (const char *current = format; *current && length < size; current++) {
+    if (*current != '%') {
+      message[length++] = *current;
+      continue;
+    }
+
+    current++;
+    if (*current == 'd') {
+      length += format_integer(message + length, size - length,
+                               va_arg(arguments, int));
+    } else if (current[0] == 'l' && current[1] == 'd') {
+      current++;
+      length += format_integer(message + length, size - length,
+                               va_arg(arguments, long));
+    } else if (*current == 's') {
+      const char *string = va_arg(arguments, const char *);
+      while (*string && length < size)
+        message[length++] = *string++;
+    } else if (*current == '%') {
+      message[length++] = '%';
+    } else {
+      break;
+    }
+  }
+  return length;
+}
+
+/*
+ * Function: write_message
+ * -----------------------------------------------------------------------------
+ * A reentrant function that takes a file descriptor, a format and arguments.
+ * Render the whole message into a stack buffer with format_message and
+ *   write it with a single write, so messages from concurrent completions
+ *   do not interleave. Messages longer than MAX_MESSAGE_LENGTH are truncated.
+ *   errno is preserved.
+ */
+void write_message(int file_descriptor, const char *format, ...) {
+
+  char message[MAX_MESSAGE_LENGTH];
+  int saved_errno = errno;
+  va_list arguments;
+  va_start(arguments, format);
+  size_t length = format_message(message, sizeof(message), format, arguments);
+  va_end(arguments);
+
+  write_all(file_descriptor, message, length);
+  errno = saved_errno;
+}
+
+/*
+ * Function: notify_completion
+ * -----------------------------------------------------------------------------
+ * Takes a format and arguments, like write_message, describing a finished
+ *   background job.
+ * Queue the message to be printed before the next prompt, or print it
+ *   right away if the notify option is set (set -b).
+ */
+void notify_completion(const char *format, ...) {
+
+  char message[MAX_MESSAGE_LENGTH];
+  va_list arguments;
+  va_start(arguments, format);
+  size_t length = format_message(message, sizeof(message), format, arguments);
+  va_end(arguments);
+
+  if (program_status.notify) {
+    write_all(STDOUT_FILENO, message, length);
+  } else {
+    append_buffer(&pending_notifications, message, length);
+    num_pending_notifications++;
+  }
+}
+
+/*
+ * Function: flush_notifications
+ * -----------------------------------------------------------------------------
+ * Print the queued completion messages with a single write, before a prompt.
+ * When more than MAX_LISTED_NOTIFICATIONS jobs finished, print a summary line
+ *   instead and keep the messages for "jobs -d".
+ */
+void flush_notifications(void) {
+
+  if (num_pending_notifications == 0)
+    return;
+
+  if (num_pending_notifications > MAX_LISTED_NOTIFICATIONS) {
+    struct byte_buffer listed = done_notifications;
+    done_notifications = pending_notifications;
+    pending_notifications = listed;
+    write_message(STDOUT_FILENO, "%d background jobs are done "
+                  "(jobs -d lists them)\n", num_pending_notifications);
+  } else {
+    write_all(STDOUT_FILENO, pending_notifications.data,
+              pending_notifications.length);
+  }
+
+  pending_notifications.length = 0;
+  num_pending_notifications = 0;
+}
+
+/*
+ * Function: open_redirection
+ * -----------------------------------------------------------------------------
+ * Takes the user command and redirection mode as parameters.
+ *   Open the provided filename (if available) based on the redirection mode,
+ *   or duplicate the provided descriptor for <&N and >&N.
+ * If the process is a background process and no filename is given, 
+ *   then /dev/null is opened instead.
+ * Returns the new file descriptor, the standard input or output if there is
+ *   nothing to redirect, or -1 if the file cannot be opened.
+ */
+int open_redirection(struct command *user_command, int mode) {
+
+  // Duplicated descriptors are copied, so the copy can be closed after use
+  int descriptor = mode == INPUT ? user_command->input_descriptor
+                                 : user_command->output_descriptor;
+  if (descriptor != -1) {
+    int file_descriptor = fcntl(descriptor, F_DUPFD_CLOEXEC, 3);
+    if (file_descriptor == -1) {
+      printf("bad file descriptor %d\n", descriptor);
+      fflush(stdout);
+    }
+    return file_descriptor;
+  }
+
+  // Get filename
+  char *filename;
+  if (mode == INPUT) {
+    filename = user_command->input_file;
+  } else {
+    filename = user_command->output_file;
+  }
+
+  // Handle missing files
+  if (!filename) {
+    if (user_command->background)
+      filename = "/dev/null";
+    else
+      return mode;
+  }
+
+	// Get file name and open file
+  int file_descriptor;
+  char *mode_string;
+  if (mode == INPUT) {
+    file_descriptor = open(filename, O_RDONLY | O_CLOEXEC);
+    mode_string = "input";
+
+  } else {
+    file_descriptor = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                           0644);
+    mode_string = "output";
+  }
+
+  // Handle file opening error
+	if (file_descriptor == -1) { 
+		printf("cannot open %s for %s\n", filename, mode_string);
+    fflush(stdout);
+	}
+
+  return file_descriptor;
+}
+
+/*
+ * Function: redirect
+ * -----------------------------------------------------------------------------
+ * Takes the user command and redirection mode as parameters.
+ *   Redirect the input or output to the provided filename (if available)
+ *     based on the redirection mode.
+ * If the process is a background process and no filename is given, 
+ *   then the input or output will be redirected to /dev/null
+ */
+bool redirect(struct command *user_command, int mode) {
+
+  int file_descriptor = open_redirection(user_command, mode);
+  if (file_descriptor == -1)
+    return false;
+  if (file_descriptor == mode)
+    return true;
+
+	// Redirection to designated file
+  int result = dup2(file_descriptor, mode);
+	if (result == -1) { 
+		printf("redirection to %s failed\n", mode == INPUT ?
+           user_command->input_file : user_command->output_file);
+    fflush(stdout);
 		return false;
 	}
 
-  // Close file descriptor on when exec is called
-  fcntl(file_descriptor, F_SETFD, FD_CLOEXEC);
+  // The original descriptor is closed when exec is called
+  return true;
+}
+
+/*
+ * Function: append_buffer
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to a byte buffer, data and its length as parameters.
+ * Append the data to the end of the buffer, growing it as necessary.
+ */
+void append_buffer(struct byte_buffer *buffer, const char *data, size_t length) {
+
+  if (buffer->length + length > buffer->capacity) {
+    size_t new_capacity = buffer->capacity ? buffer->capacity : 4096;
+    while (new_capacity < buffer->length + length)
+      new_capacity *= 2;
+    buffer->data = realloc(buffer->data, new_capacity);
+    buffer->capacity = new_capacity;
+  }
+
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+}
+
+/*
+ * Function: consume_buffer
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to a byte buffer and a length as parameters.
+ * Remove the given number of bytes from the front of the buffer.
+ */
+void consume_buffer(struct byte_buffer *buffer, size_t length) {
+
+  memmove(buffer->data, buffer->data + length, buffer->length - length);
+  buffer->length -= length;
+}
+
+/*
+ * Function: write_all
+ * -----------------------------------------------------------------------------
+ * Takes a file descriptor, data and its length as parameters.
+ * Write all of the data, retrying on partial writes and interruptions.
+ * Returns true if all data has been written.
+ */
+bool write_all(int file_descriptor, const char *data, size_t length) {
+
+  while (length > 0) {
+    ssize_t num_bytes = write(file_descriptor, data, length);
+    if (num_bytes == -1) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += num_bytes;
+    length -= num_bytes;
+  }
+  return true;
+}
+
+/*
+ * Function: hash_key_field
+ * -----------------------------------------------------------------------------
+ * Takes a line, its length and a 1-based field number as parameters.
+ * Returns the FNV-1a hash of the whitespace separated field,
+ *   or the hash of an empty field if the line is shorter.
+ */
+unsigned long hash_key_field(const char *line, size_t length, int field) {
+
+  size_t index = 0;
+  size_t field_start = 0;
+  size_t field_end = 0;
+
+  for (int current = 1; current <= field; current++) {
+    while (index < length && (line[index] == ' ' || line[index] == '\t'))
+      index++;
+    field_start = index;
+    while (index < length && line[index] != ' ' && line[index] != '\t' &&
+           line[index] != '\n')
+      index++;
+    field_end = index;
+  }
+
+  unsigned long hash = 14695981039346656037UL;
+  for (size_t i = field_start; i < field_end; i++) {
+    hash ^= (unsigned char)line[i];
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+/*
+ * Function: start_shard_worker
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to a shard worker and the worker command as parameters.
+ * Create the input and output pipes of the worker and
+ *   start the command with its stdin and stdout connected to them.
+ * Returns true if the worker has been started.
+ */
+bool start_shard_worker(struct shard_worker *worker, char **worker_command) {
+
+  int input_pipe[2];
+  int output_pipe[2];
+  if (pipe2(input_pipe, O_CLOEXEC) == -1)
+    return false;
+  if (pipe2(output_pipe, O_CLOEXEC) == -1) {
+    close(input_pipe[0]);
+    close(input_pipe[1]);
+    return false;
+  }
+  set_pipe_size(input_pipe[1], program_status.pipe_size);
+  set_pipe_size(output_pipe[1], program_status.pipe_size);
+
+  worker->process_id = fork();
+  num_forks++;
+  switch (worker->process_id) {
+
+    case -1:
+      perror("fork() failed");
+      return false;
+
+    case 0:
+      dup2(input_pipe[0], STDIN_FILENO);
+      dup2(output_pipe[1], STDOUT_FILENO);
+      execvp(worker_command[0], worker_command);
+      perror(worker_command[0]);
+      exit(FAILURE);
+
+    default:
+      close(input_pipe[0]);
+      close(output_pipe[1]);
+      worker->input_fd = input_pipe[1];
+      worker->output_fd = output_pipe[0];
+      return true;
+  }
+}
+
+/*
+ * Function: flush_merged_lines
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to a shard worker and whether the worker has finished.
+ * Write the complete lines collected from the worker to stdout, so output
+ *   of different workers is only ever interleaved at line boundaries.
+ * Once the worker has finished, its unterminated last line is written too.
+ */
+void flush_merged_lines(struct shard_worker *worker, bool finished) {
+
+  struct byte_buffer *merged = &worker->merged;
+  size_t length = merged->length;
+
+  if (!finished) {
+    while (length > 0 && merged->data[length - 1] != '\n')
+      length--;
+  }
+
+  if (length > 0) {
+    write_all(STDOUT_FILENO, merged->data, length);
+    consume_buffer(merged, length);
+  }
+}
+
+/*
+ * Function: record_shard_line
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to the shard state and the worker given an input line.
+ * Record the line in the input order, extending the last record when it
+ *   went to the same worker.
+ */
+void record_shard_line(struct shard_state *state, int worker) {
+
+  struct shard_batch *last = (struct shard_batch *)
+    (state->order.data + state->order.length) - 1;
+  if (state->order.length > state->order_start && last->worker == worker) {
+    last->num_lines++;
+    return;
+  }
+
+  struct shard_batch batch = {worker, 1};
+  append_buffer(&state->order, (char *) &batch, sizeof(batch));
+}
+
+/*
+ * Function: flush_ordered_lines
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to the shard state as parameter.
+ * Write the output of the workers to stdout in input order, assuming each
+ *   worker writes one output line per input line, as a map step such as
+ *   tr, sed or cut does. The output of a record is written once the worker
+ *   has produced that many lines, or has finished. Workers writing more or
+ *   fewer lines still have all of their output written, each finished
+ *   worker's remaining output once the records before it are written.
+ */
+void flush_ordered_lines(struct shard_state *state) {
+
+  while (state->order_start < state->order.length) {
+    struct shard_batch *batch = (struct shard_batch *)
+      (state->order.data + state->order_start);
+    struct shard_worker *worker = &state->workers[batch->worker];
+    struct byte_buffer *merged = &worker->merged;
+    bool finished = worker->output_fd == -1;
+
+    // Complete lines of the record available so far
+    size_t length = 0;
+    while (batch->num_lines > 0) {
+      char *newline = memchr(merged->data + length, '\n',
+                             merged->length - length);
+      if (!newline)
+        break;
+      length = newline - merged->data + 1;
+      batch->num_lines--;
+    }
+    if (finished && batch->num_lines > 0)
+      length = merged->length;
+
+    if (length > 0) {
+      write_all(STDOUT_FILENO, merged->data, length);
+      consume_buffer(merged, length);
+    }
+    if (batch->num_lines > 0 && !finished)
+      break;
+    state->order_start += sizeof(struct shard_batch);
+  }
+
+  // Drop the written records once they make up most of the buffer
+  if (state->order_start > state->order.length / 2) {
+    consume_buffer(&state->order, state->order_start);
+    state->order_start = 0;
+  }
+
+  // Once everything is written, output beyond the records goes out too
+  if (state->order_start == state->order.length && state->input_done) {
+    for (int i = 0; i < state->num_workers; i++) {
+      if (state->workers[i].output_fd == -1)
+        flush_merged_lines(&state->workers[i], true);
+    }
+  }
+}
+
+/*
+ * Function: distribute_input
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to the shard state, newly read input and its length as
+ *   parameters, a length of 0 meaning the end of input.
+ * Queue every complete line for a worker: round-robin in batches of
+ *   SHARD_BATCH_SIZE bytes, or by the hash of the key field.
+ */
+void distribute_input(struct shard_state *state, const char *data,
+                      size_t length) {
+
+  struct byte_buffer *unfinished_line = &state->unfinished_line;
+
+  if (length > 0) {
+    append_buffer(unfinished_line, data, length);
+  } else {
+    state->input_done = true;
+
+    // Terminate the last line so it reaches a worker as a whole line
+    if (unfinished_line->length > 0 &&
+        unfinished_line->data[unfinished_line->length - 1] != '\n')
+      append_buffer(unfinished_line, "\n", 1);
+  }
+
+  size_t line_start = 0;
+  char *newline;
+  while ((newline = memchr(unfinished_line->data + line_start, '\n',
+                           unfinished_line->length - line_start))) {
+    size_t line_end = newline - unfinished_line->data + 1;
+    size_t line_length = line_end - line_start;
+    char *line = unfinished_line->data + line_start;
+
+    int target = state->next_worker;
+    if (state->key_field > 0) {
+      target = hash_key_field(line, line_length, state->key_field) %
+               state->num_workers;
+
+    // Move to the next worker once the current batch is full
+    } else if ((state->batch_length += line_length) >= SHARD_BATCH_SIZE) {
+      state->next_worker = (state->next_worker + 1) % state->num_workers;
+      state->batch_length = 0;
+    }
+
+    if (state->workers[target].input_fd != -1) {
+      append_buffer(&state->workers[target].pending, line, line_length);
+      if (state->ordered)
+        record_shard_line(state, target);
+    }
+    line_start = line_end;
+  }
+  consume_buffer(unfinished_line, line_start);
+}
+
+/*
+ * Function: accepts_input
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to the shard state as parameter.
+ * Returns true if more stdin should be read, which is not the case while
+ *   any worker still has a full batch queued.
+ */
+bool accepts_input(struct shard_state *state) {
+
+  if (state->input_done)
+    return false;
+
+  for (int i = 0; i < state->num_workers; i++) {
+    struct shard_worker *worker = &state->workers[i];
+    if (worker->pending.length + worker->in_flight.length >= SHARD_BATCH_SIZE)
+      return false;
+  }
+  return true;
+}
+
+/*
+ * Function: close_worker_input
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to a shard worker as parameter.
+ * Close the stdin pipe of the worker and drop anything still queued for it.
+ */
+void close_worker_input(struct shard_worker *worker) {
+
+  close(worker->input_fd);
+  worker->input_fd = -1;
+  worker->pending.length = 0;
+  worker->in_flight.length = 0;
+}
+
+/*
+ * Function: collect_worker_output
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to the shard state, a worker, output read from the worker
+ *   and its length as parameters, a length of 0 meaning the end of output.
+ * Merge the output into stdout, closing the pipe at the end of output.
+ * In ordered mode the output waits until the lines before it are written.
+ */
+void collect_worker_output(struct shard_state *state,
+                           struct shard_worker *worker, const char *data,
+                           size_t length) {
+
+  if (length > 0) {
+    append_buffer(&worker->merged, data, length);
+    if (state->ordered)
+      flush_ordered_lines(state);
+    else
+      flush_merged_lines(worker, false);
+    return;
+  }
+
+  close(worker->output_fd);
+  worker->output_fd = -1;
+  state->open_outputs--;
+  if (state->ordered)
+    flush_ordered_lines(state);
+  else
+    flush_merged_lines(worker, true);
+}
+
+/*
+ * Function: relay_with_poll
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to the shard state as parameter.
+ * Move data between stdin, the workers and stdout with poll and
+ *   nonblocking read and write calls until every worker has finished.
+ */
+void relay_with_poll(struct shard_state *state) {
+
+  char *chunk = malloc(SHARD_BATCH_SIZE);
+  struct pollfd poll_fds[2 * MAX_SHARD_WORKERS + 1];
+
+  for (int i = 0; i < state->num_workers; i++) {
+    fcntl(state->workers[i].input_fd, F_SETFL, O_NONBLOCK);
+    fcntl(state->workers[i].output_fd, F_SETFL, O_NONBLOCK);
+  }
+
+  while (state->open_outputs > 0) {
+
+    bool accept_input = accepts_input(state);
+    int num_fds = 0;
+    if (accept_input) {
+      poll_fds[num_fds].fd = STDIN_FILENO;
+      poll_fds[num_fds++].events = POLLIN;
+    }
+    for (int i = 0; i < state->num_workers; i++) {
+      struct shard_worker *worker = &state->workers[i];
+      worker->input_index = -1;
+      worker->output_index = -1;
+      if (worker->input_fd != -1 && worker->pending.length > 0) {
+        worker->input_index = num_fds;
+        poll_fds[num_fds].fd = worker->input_fd;
+        poll_fds[num_fds++].events = POLLOUT;
+      }
+      if (worker->output_fd != -1) {
+        worker->output_index = num_fds;
+        poll_fds[num_fds].fd = worker->output_fd;
+        poll_fds[num_fds++].events = POLLIN;
+      }
+    }
+
+    if (poll(poll_fds, num_fds, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      break;
+    }
+
+    // Distribute newly read lines
+    if (accept_input && poll_fds[0].revents) {
+      ssize_t num_bytes = read(STDIN_FILENO, chunk, SHARD_BATCH_SIZE);
+      if (num_bytes >= 0 || errno != EINTR)
+        distribute_input(state, chunk, num_bytes > 0 ? num_bytes : 0);
+    }
+
+    for (int i = 0; i < state->num_workers; i++) {
+      struct shard_worker *worker = &state->workers[i];
+
+      // Feed queued lines to the worker
+      if (worker->input_index != -1 && poll_fds[worker->input_index].revents) {
+        ssize_t num_bytes = write(worker->input_fd, worker->pending.data,
+                                  worker->pending.length);
+        if (num_bytes > 0)
+          consume_buffer(&worker->pending, num_bytes);
+        else if (num_bytes == -1 && errno != EAGAIN && errno != EINTR)
+          close_worker_input(worker);
+      }
+
+      // Close the input of the worker once everything has been delivered
+      if (state->input_done && worker->input_fd != -1 &&
+          worker->pending.length == 0)
+        close_worker_input(worker);
+
+      // Merge the output of the worker
+      if (worker->output_index != -1 && poll_fds[worker->output_index].revents) {
+        ssize_t num_bytes = read(worker->output_fd, chunk, SHARD_BATCH_SIZE);
+        if (num_bytes >= 0 || (errno != EAGAIN && errno != EINTR))
+          collect_worker_output(state, worker, chunk,
+                                num_bytes > 0 ? num_bytes : 0);
+      }
+    }
+  }
+
+  free(chunk);
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * Function: setup_uring
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to a ring and the number of submission entries.
+ * Create an io_uring instance and map its rings with raw system calls.
+ * Returns false if the kernel does not support io_uring, or lacks reads and
+ *   writes at the current file position (Linux 5.6), so the caller can
+ *   fall back to poll.
+ */
+bool setup_uring(struct uring *ring, unsigned entries) {
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->file_descriptor = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->file_descriptor == -1)
+    return false;
+
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(params.features & IORING_FEAT_RW_CUR_POS)) {
+    close(ring->file_descriptor);
+    return false;
+  }
+
+  // Submission and completion rings share a single mapping
+  ring->ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t completion_size = params.cq_off.cqes +
+                           params.cq_entries * sizeof(struct io_uring_cqe);
+  if (completion_size > ring->ring_size)
+    ring->ring_size = completion_size;
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->ring_memory = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring->file_descriptor,
+                           IORING_OFF_SQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->file_descriptor,
+                    IORING_OFF_SQES);
+  if (ring->ring_memory == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    if (ring->ring_memory != MAP_FAILED)
+      munmap(ring->ring_memory, ring->ring_size);
+    if (ring->sqes != MAP_FAILED)
+      munmap(ring->sqes, ring->sqes_size);
+    close(ring->file_descriptor);
+    return false;
+  }
+
+  char *memory = ring->ring_memory;
+  ring->sq_tail = (unsigned *)(memory + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(memory + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(memory + params.sq_off.array);
+  ring->cq_head = (unsigned *)(memory + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(memory + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(memory + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(memory + params.cq_off.cqes);
+  ring->to_submit = 0;
+  return true;
+}
+
+/*
+ * Function: queue_uring_operation
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to a ring, an opcode, a file descriptor, a buffer, its
+ *   length and the user data identifying the operation as parameters.
+ * Fill the next submission entry with a read or write at the current
+ *   file position. It is submitted by the next wait_uring.
+ */
+void queue_uring_operation(struct uring *ring, int opcode, int file_descriptor,
+                           void *buffer, size_t length, unsigned long tag) {
+
+  unsigned tail = *ring->sq_tail;
+  unsigned index = tail & ring->sq_mask;
+  struct io_uring_sqe *entry = &ring->sqes[index];
+
+  memset(entry, 0, sizeof(*entry));
+  entry->opcode = opcode;
+  entry->fd = file_descriptor;
+  entry->addr = (unsigned long)buffer;
+  entry->len = length;
+  entry->off = (unsigned long long)-1;
+  entry->user_data = tag;
+
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+}
+
+/*
+ * Function: wait_uring
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to a ring as parameter.
+ * Submit the queued operations and wait for at least one completion,
+ *   both with a single io_uring_enter call.
+ * Returns false on failure.
+ */
+bool wait_uring(struct uring *ring) {
+
+  while (syscall(__NR_io_uring_enter, ring->file_descriptor, ring->to_submit,
+                 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1) {
+    if (errno != EINTR)
+      return false;
+  }
+  ring->to_submit = 0;
+  return true;
+}
+
+/*
+ * Function: relay_with_uring
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to the shard state as parameter.
+ * Move data between stdin, the workers and stdout with io_uring, keeping
+ *   one read of stdin and one write and one read per worker in flight, and
+ *   submitting and reaping all of them with one system call per round.
+ * Returns false without touching any descriptor if io_uring is unavailable.
+ */
+bool relay_with_uring(struct shard_state *state) {
+
+  struct uring ring;
+  char *backend = getenv("SMALLSH_IO_BACKEND");
+  if ((backend && strcmp(backend, "poll") == 0) ||
+      !setup_uring(&ring, 2 * state->num_workers + 1))
+    return false;
+
+  char *input_chunk = malloc(SHARD_BATCH_SIZE);
+  char *output_chunks = malloc((size_t)state->num_workers * SHARD_BATCH_SIZE);
+  bool input_busy = false;
+
+  while (state->open_outputs > 0) {
+
+    if (!input_busy && accepts_input(state)) {
+      queue_uring_operation(&ring, IORING_OP_READ, STDIN_FILENO, input_chunk,
+                            SHARD_BATCH_SIZE, URING_READ_INPUT);
+      input_busy = true;
+    }
+
+    for (int i = 0; i < state->num_workers; i++) {
+      struct shard_worker *worker = &state->workers[i];
+
+      // Writes run from in_flight while new lines are queued in pending
+      if (worker->input_fd != -1 && !worker->input_busy &&
+          worker->in_flight.length == 0 && worker->pending.length > 0) {
+        struct byte_buffer swap = worker->in_flight;
+        worker->in_flight = worker->pending;
+        worker->pending = swap;
+      }
+      if (worker->input_fd != -1 && !worker->input_busy &&
+          worker->in_flight.length > 0) {
+        queue_uring_operation(&ring, IORING_OP_WRITE, worker->input_fd,
+                              worker->in_flight.data, worker->in_flight.length,
+                              (unsigned long)i << 2 | URING_WRITE_WORKER);
+        worker->input_busy = true;
+      }
+
+      // Close the input of the worker once everything has been delivered
+      if (state->input_done && worker->input_fd != -1 && !worker->input_busy &&
+          worker->pending.length == 0 && worker->in_flight.length == 0)
+        close_worker_input(worker);
+
+      if (worker->output_fd != -1 && !worker->output_busy) {
+        queue_uring_operation(&ring, IORING_OP_READ, worker->output_fd,
+                              output_chunks + (size_t)i * SHARD_BATCH_SIZE,
+                              SHARD_BATCH_SIZE,
+                              (unsigned long)i << 2 | URING_READ_WORKER);
+        worker->output_busy = true;
+      }
+    }
+
+    if (!wait_uring(&ring)) {
+      perror("io_uring_enter");
+      break;
+    }
+
+    // Handle every completion that has arrived
+    unsigned head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *completion = &ring.cqes[head & ring.cq_mask];
+      int result = completion->res;
+      int operation = completion->user_data & 3;
+      struct shard_worker *worker = &state->workers[completion->user_data >> 2];
+      head++;
+
+      if (operation == URING_READ_INPUT) {
+        input_busy = false;
+        if (result != -EINTR && result != -EAGAIN)
+          distribute_input(state, input_chunk, result > 0 ? result : 0);
+
+      } else if (operation == URING_WRITE_WORKER) {
+        worker->input_busy = false;
+        if (result > 0)
+          consume_buffer(&worker->in_flight, result);
+        else if (result != -EINTR && result != -EAGAIN)
+          close_worker_input(worker);
+
+      } else {
+        worker->output_busy = false;
+        if (result != -EINTR && result != -EAGAIN)
+          collect_worker_output(state, worker, output_chunks +
+                                (worker - state->workers) * SHARD_BATCH_SIZE,
+                                result > 0 ? result : 0);
+      }
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  munmap(ring.sqes, ring.sqes_size);
+  munmap(ring.ring_memory, ring.ring_size);
+  close(ring.file_descriptor);
+  free(input_chunk);
+  free(output_chunks);
+  return true;
+}
+#endif
+
+/*
+ * Function: run_shard
+ * -----------------------------------------------------------------------------
+ * Takes the arguments of the shard builtin and its context as parameters:
+ *   shard -n N [--by-key FIELD] [-k] -- cmd [args...]
+ * Start N copies of cmd, distribute stdin lines to them in batches,
+ *   round-robin or by the hash of the key field, and merge the output of the
+ *   workers back to stdout in arrival order, one whole line at a time.
+ * With -k the output is merged in input order instead, for workers writing
+ *   one line per input line (see flush_ordered_lines).
+ * Data is relayed through io_uring where the kernel supports it,
+ *   and through poll otherwise or with SMALLSH_IO_BACKEND=poll.
+ * Returns the exit value of the first failing worker, or SUCCESS.
+ */
+int run_shard(char **arguments, struct builtin_context *context) {
+
+  struct shard_state state;
+  memset(&state, 0, sizeof(state));
+  char **worker_command = NULL;
+
+  // Parse options
+  for (int i = 1; arguments[i]; i++) {
+    if (strcmp(arguments[i], "-n") == 0 && arguments[i + 1]) {
+      state.num_workers = atoi(arguments[++i]);
+    } else if (strcmp(arguments[i], "--by-key") == 0 && arguments[i + 1]) {
+      state.key_field = atoi(arguments[++i]);
+    } else if (strcmp(arguments[i], "-k") == 0) {
+      state.ordered = true;
+    } else if (strcmp(arguments[i], "--") == 0) {
+      worker_command = &arguments[i + 1];
+      break;
+    } else {
+      break;
+    }
+  }
+
+  if (state.num_workers < 1 || state.num_workers > MAX_SHARD_WORKERS ||
+      state.key_field < 0 || !worker_command || !worker_command[0]) {
+    fprintf(stderr,
+            "usage: shard -n N [--by-key FIELD] [-k] -- cmd [args...]\n");
+    return FAILURE;
+  }
+
+  // A worker exiting early must not kill the distributor
+  signal(SIGPIPE, SIG_IGN);
+
+  state.workers = calloc(state.num_workers, sizeof(struct shard_worker));
+  for (int i = 0; i < state.num_workers; i++) {
+    if (!start_shard_worker(&state.workers[i], worker_command)) {
+      stop_shard_workers(&state, i);
+      return FAILURE;
+    }
+  }
+  state.open_outputs = state.num_workers;
+
+#ifdef HAVE_IO_URING
+  if (!relay_with_uring(&state))
+#endif
+    relay_with_poll(&state);
+
+  // Collect exit values of the workers
+  int exit_value = SUCCESS;
+  for (int i = 0; i < state.num_workers; i++) {
+    struct shard_worker *worker = &state.workers[i];
+    int exit_method;
+    if (worker->input_fd != -1)
+      close(worker->input_fd);
+    waitpid(worker->process_id, &exit_method, 0);
+    if (exit_value == SUCCESS && WIFEXITED(exit_method))
+      exit_value = WEXITSTATUS(exit_method);
+    else if (exit_value == SUCCESS && WIFSIGNALED(exit_method))
+      exit_value = FAILURE;
+    free(worker->pending.data);
+    free(worker->in_flight.data);
+    free(worker->merged.data);
+  }
+
+  free(state.workers);
+  free(state.unfinished_line.data);
+  free(state.order.data);
+  return exit_value;
+}
+
+/*
+ * Function: stop_shard_workers
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to the shard state and the number of started workers.
+ * Terminate and reap the started workers when the others failed to start.
+ */
+void stop_shard_workers(struct shard_state *state, int num_started) {
+
+  for (int i = 0; i < num_started; i++) {
+    close(state->workers[i].input_fd);
+    close(state->workers[i].output_fd);
+    kill(state->workers[i].process_id, SIGTERM);
+    waitpid(state->workers[i].process_id, NULL, 0);
+  }
+  free(state->workers);
+}
+
+/*
+ * Function: strip_separator
+ * -----------------------------------------------------------------------------
+ * Takes a token of a compound command as parameter.
+ * Remove a trailing ";" separator from the token.
+ * Returns true if the token had a separator.
+ */
+bool strip_separator(char *token) {
+
+  size_t length = strlen(token);
+  if (length > 0 && token[length - 1] == ';') {
+    token[length - 1] = '\0';
+    return true;
+  }
+  return false;
+}
+
+/*
+ * Function: substitute_loop_variable
+ * -----------------------------------------------------------------------------
+ * Takes an argument, a loop variable name and its value as parameters.
+ * Returns a newly allocated copy of the argument with every "$name" and
+ *   "${name}" replaced by the value.
+ */
+char *substitute_loop_variable(char *argument, char *name, char *value) {
+
+  struct byte_buffer result = {NULL, 0, 0};
+  size_t name_length = strlen(name);
+  char *current = argument;
+
+  while (*current) {
+    if (current[0] == '$' && strncmp(current + 1, name, name_length) == 0 &&
+        !isalnum((unsigned char)current[name_length + 1]) &&
+        current[name_length + 1] != '_') {
+      append_buffer(&result, value, strlen(value));
+      current += name_length + 1;
+
+    } else if (strncmp(current, "${", 2) == 0 &&
+               strncmp(current + 2, name, name_length) == 0 &&
+               current[name_length + 2] == '}') {
+      append_buffer(&result, value, strlen(value));
+      current += name_length + 3;
+
+    } else {
+      append_buffer(&result, current, 1);
+      current++;
+    }
+  }
+
+  append_buffer(&result, "", 1);
+  return result.data;
+}
+
+/*
+ * Function: start_pfor_iteration
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to the iteration, the loop body, the loop variable name,
+ *   the item and whether output should be kept in order as parameters.
+ * Start the loop body with the variable substituted by the item.
+ * In ordered mode, stdout of the iteration goes to a memory file, which is
+ *   close-on-exec so later iterations do not inherit it.
+ * Returns true if the iteration has been started.
+ */
+bool start_pfor_iteration(struct pfor_iteration *iteration, char **body,
+                          char *name, char *item, bool ordered) {
+
+  iteration->output_fd = -1;
+  if (ordered && (iteration->output_fd = memfd_create("smallsh-pfor",
+                                                      MFD_CLOEXEC)) == -1) {
+    perror("memfd_create");
+    return false;
+  }
+
+  iteration->process_id = fork();
+  num_forks++;
+  switch (iteration->process_id) {
+
+    case -1:
+      perror("fork() failed");
+      if (iteration->output_fd != -1)
+        close(iteration->output_fd);
+      iteration->output_fd = -1;
+      return false;
+
+    case 0: {
+      int num_arguments = 0;
+      while (body[num_arguments])
+        num_arguments++;
+
+      char *arguments[num_arguments + 1];
+      for (int i = 0; i < num_arguments; i++)
+        arguments[i] = substitute_loop_variable(body[i], name, item);
+      arguments[num_arguments] = NULL;
+
+      if (ordered)
+        dup2(iteration->output_fd, STDOUT_FILENO);
+
+      execvp(arguments[0], arguments);
+      perror(arguments[0]);
+      exit(FAILURE);
+    }
+
+    default:
+      return true;
+  }
+}
+
+/*
+ * Function: flush_pfor_output
+ * -----------------------------------------------------------------------------
+ * Takes the iterations, the number of iterations and the index of
+ *   the next iteration to be written as parameters.
+ * Copy the captured output of finished iterations to stdout in loop order,
+ *   stopping at the first iteration that has not finished.
+ * Returns the index of the next iteration to be written.
+ */
+int flush_pfor_output(struct pfor_iteration *iterations, int num_items,
+                      int next_output) {
+
+  while (next_output < num_items && iterations[next_output].finished) {
+    if (iterations[next_output].output_fd != -1) {
+      emit_captured_output(iterations[next_output].output_fd, STDOUT_FILENO);
+      iterations[next_output].output_fd = -1;
+    }
+    next_output++;
+  }
+  return next_output;
+}
+
+/*
+ * Function: run_pfor
+ * -----------------------------------------------------------------------------
+ * Takes the arguments of the pfor builtin as parameter:
+ *   pfor x in ITEM... ; do cmd [args...] ; done [-j N] [-k]
+ * Run the body once per item with $x substituted, up to N iterations at a
+ *   time (the number of online cores by default). Free slots always take the
+ *   next item of the shared queue, so uneven iterations balance out.
+ * With -k, output of each iteration is written in loop order, and at most
+ *   MAX_PFOR_AHEAD iterations are started past the next one to be written,
+ *   bounding the captured output kept open behind a slow iteration.
+ * With a jobserver (set -o jobs=N), iterations beyond the first also need
+ *   a free token, so they share the slots with the other jobs of the shell.
+ * The loop fails fast: once an iteration fails, no new iterations are
+ *   started and the running ones are terminated.
+ * Returns the exit value of the failed iteration, or SUCCESS.
+ */
+int run_pfor(char **arguments, struct builtin_context *context) {
+
+  int num_arguments = 0;
+  while (arguments[num_arguments])
+    num_arguments++;
+
+  char *name = arguments[1];
+  char **queue = calloc(num_arguments + 1, sizeof(char *));
+  char **body = calloc(num_arguments + 1, sizeof(char *));
+  int num_items = 0;
+  int num_body = 0;
+  int max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  bool ordered = false;
+  bool valid = name && arguments[2] && strcmp(arguments[2], "in") == 0;
+
+  // Item list up to "do"
+  int index = 3;
+  for (; valid && arguments[index]; index++) {
+    if (strcmp(arguments[index], "do") == 0)
+      break;
+    strip_separator(arguments[index]);
+    if (arguments[index][0])
+      queue[num_items++] = arguments[index];
+  }
+  valid = valid && arguments[index];
+
+  // Loop body up to "done"
+  if (valid) {
+    for (index++; arguments[index]; index++) {
+      if (strcmp(arguments[index], "done") == 0)
+        break;
+      strip_separator(arguments[index]);
+      if (arguments[index][0])
+        body[num_body++] = arguments[index];
+    }
+    valid = arguments[index] && num_body > 0;
+  }
+
+  // Options after "done"
+  if (valid) {
+    for (index++; arguments[index]; index++) {
+      if (strcmp(arguments[index], "-j") == 0 && arguments[index + 1])
+        max_jobs = atoi(arguments[++index]);
+      else if (strcmp(arguments[index], "-k") == 0)
+        ordered = true;
+      else
+        valid = false;
+    }
+  }
+
+  if (!valid || max_jobs < 1) {
+    fprintf(stderr,
+            "usage: pfor x in ITEM... ; do cmd [args...] ; done [-j N] [-k]\n");
+    free(queue);
+    free(body);
+    return FAILURE;
+  }
+
+  struct pfor_iteration *iterations = calloc(num_items + 1,
+                                             sizeof(struct pfor_iteration));
+  int next_item = 0;
+  int next_output = 0;
+  int running = 0;
+  int exit_value = SUCCESS;
+
+  while (next_item < num_items || running > 0) {
+
+    // Fill free slots from the queue unless the loop has failed
+    while (exit_value == SUCCESS && running < max_jobs &&
+           next_item < num_items &&
+           (!ordered || next_item < next_output + MAX_PFOR_AHEAD)) {
+
+      // Iterations beyond the first run on jobserver tokens
+      if (running > 0 && jobserver.size > 0 && !try_job_token())
+        break;
+      if (!start_pfor_iteration(&iterations[next_item], body, name,
+                                queue[next_item], ordered)) {
+        if (running > 0 && jobserver.size > 0)
+          release_job_token();
+        exit_value = FAILURE;
+        break;
+      }
+      next_item++;
+      running++;
+    }
+
+    if (running == 0)
+      break;
+
+    int exit_method;
+    pid_t pid = waitpid(-1, &exit_method, 0);
+    if (pid == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    for (int i = 0; i < next_item; i++) {
+      if (iterations[i].process_id != pid || iterations[i].finished)
+        continue;
+
+      iterations[i].finished = true;
+      running--;
+      if (running > 0 && jobserver.size > 0)
+        release_job_token();
+
+      bool failed = !WIFEXITED(exit_method) || WEXITSTATUS(exit_method) != 0;
+      if (failed && exit_value == SUCCESS) {
+        exit_value = WIFEXITED(exit_method) ? WEXITSTATUS(exit_method)
+                                            : FAILURE;
+
+        // Fail fast, terminating the other running iterations
+        for (int j = 0; j < next_item; j++) {
+          if (!iterations[j].finished)
+            kill(iterations[j].process_id, SIGTERM);
+        }
+      }
+      break;
+    }
+
+    if (ordered)
+      next_output = flush_pfor_output(iterations, next_item, next_output);
+  }
+
+  for (int i = 0; i < next_item; i++) {
+    if (iterations[i].output_fd != -1)
+      close(iterations[i].output_fd);
+  }
+  free(iterations);
+  free(queue);
+  free(body);
+  return exit_value;
+}
+
+/*
+ * Function: create_shared_segment
+ * -----------------------------------------------------------------------------
+ * Takes the name and size of a shared memory segment, and the function
+ *   initializing it with its argument.
+ * Build and initialize the segment under a temporary name, then publish it
+ *   by linking it to the real name in SHM_DIRECTORY, so the segment is only
+ *   ever seen complete, even if its creator dies halfway.
+ * Returns a descriptor of the published segment, or of the one another
+ *   process published first, or -1 with errno set.
+ */
+int create_shared_segment(const char *name, size_t size,
+                          void (*initialize)(void *segment, int argument),
+                          int argument) {
+
+  char temporary[NAME_MAX];
+  snprintf(temporary, sizeof(temporary), "%s.%d", name, (int)getpid());
+  int file_descriptor = shm_open(temporary, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (file_descriptor == -1)
+    return -1;
+
+  void *segment = MAP_FAILED;
+  if (ftruncate(file_descriptor, size) == 0)
+    segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   file_descriptor, 0);
+  if (segment == MAP_FAILED) {
+    int error = errno;
+    shm_unlink(temporary);
+    close(file_descriptor);
+    errno = error;
+    return -1;
+  }
+  initialize(segment, argument);
+  munmap(segment, size);
+
+  // Publish the segment, unless another process was first
+  char temporary_path[PATH_MAX], path[PATH_MAX];
+  snprintf(temporary_path, sizeof(temporary_path), SHM_DIRECTORY "%s",
+           temporary);
+  snprintf(path, sizeof(path), SHM_DIRECTORY "%s", name);
+  int published = link(temporary_path, path);
+  int error = errno;
+  shm_unlink(temporary);
+  if (published == 0)
+    return file_descriptor;
+
+  close(file_descriptor);
+  if (error == EEXIST)
+    return shm_open(name, O_RDWR, 0);
+  errno = error;
+  return -1;
+}
+
+/*
+ * Function: map_shared_segment
+ * -----------------------------------------------------------------------------
+ * Takes the name, size and magic number of a shared memory segment, and the
+ *   function initializing it with its argument.
+ * Map the segment, creating it (see create_shared_segment) if it does not
+ *   exist. As any user may create the name first, the segment is only used
+ *   if it belongs to the user, is not accessible by other users, has the
+ *   size and starts with the magic number.
+ * Returns the mapping, or NULL after printing an error.
+ */
+void *map_shared_segment(const char *name, size_t size, unsigned int magic,
+                         void (*initialize)(void *segment, int argument),
+                         int argument) {
+
+  int file_descriptor = shm_open(name, O_RDWR, 0);
+  if (file_descriptor == -1 && errno == ENOENT)
+    file_descriptor = create_shared_segment(name, size, initialize, argument);
+  if (file_descriptor == -1) {
+    perror("shm_open");
+    return NULL;
+  }
+
+  struct stat file_info;
+  if (fstat(file_descriptor, &file_info) == -1 ||
+      file_info.st_uid != getuid() || (file_info.st_mode & 077) != 0 ||
+      file_info.st_size != (off_t)size) {
+    fprintf(stderr, "%s: not a segment of the user\n", name);
+    close(file_descriptor);
+    return NULL;
+  }
+
+  void *segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       file_descriptor, 0);
+  close(file_descriptor);
+  if (segment == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+  if (*(unsigned int *)segment != magic) {
+    fprintf(stderr, "%s: not a segment of the user\n", name);
+    munmap(segment, size);
+    return NULL;
+  }
+  return segment;
+}
+
+/*
+ * Function: initialize_work_queue
+ * -----------------------------------------------------------------------------
+ * Takes a new work queue segment and an unused argument.
+ * Initialize the robust lock, the semaphores and the ring of the queue.
+ */
+void initialize_work_queue(void *segment, int argument) {
+
+  struct work_queue *queue = segment;
+  pthread_mutexattr_t attributes;
+  pthread_mutexattr_init(&attributes);
+  pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&queue->lock, &attributes);
+  pthread_mutexattr_destroy(&attributes);
+  sem_init(&queue->items, 1, 0);
+  sem_init(&queue->slots, 1, WORK_QUEUE_SLOTS);
+  queue->head = 0;
+  queue->tail = 0;
+  queue->magic = WORK_QUEUE_MAGIC;
+}
+
+/*
+ * Function: open_work_queue
+ * -----------------------------------------------------------------------------
+ * Map the host-local work queue shared by all smallsh instances of the user,
+ *   a shared memory segment (see map_shared_segment).
+ * Returns a pointer to the queue, or NULL if it cannot be mapped.
+ */
+struct work_queue *open_work_queue(void) {
+
+  if (!shared_queue) {
+    char name[64];
+    snprintf(name, sizeof(name), "/smallsh-queue-%d-v2", (int)getuid());
+    shared_queue = map_shared_segment(name, sizeof(struct work_queue),
+                                      WORK_QUEUE_MAGIC, initialize_work_queue,
+                                      0);
+  }
+  return shared_queue;
+}
+
+/*
+ * Function: wait_semaphore
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to a semaphore as parameter.
+ * Block in the kernel until the semaphore can be decremented,
+ *   retrying when interrupted by a signal.
+ */
+void wait_semaphore(sem_t *semaphore) {
+
+  while (sem_wait(semaphore) == -1 && errno == EINTR) {}
+}
+
+/*
+ * Function: lock_work_queue
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to the work queue as parameter.
+ * Lock the queue. If the previous owner died holding the lock, the queue
+ *   is still consistent, as head and tail only move after an entry has been
+ *   copied, so the lock is marked consistent and taken over.
+ */
+void lock_work_queue(struct work_queue *queue) {
+
+  if (pthread_mutex_lock(&queue->lock) == EOWNERDEAD)
+    pthread_mutex_consistent(&queue->lock);
+}
+
+/*
+ * Function: submit_command
+ * -----------------------------------------------------------------------------
+ * Take a pointer to user_command as parameter,
+ *   and queue the command after "submit" in the host-local work queue,
+ *   blocking while the queue is full.
+ * The command runs in the current directory of the submitting shell, with
+ *   the variables of this shell already expanded, but in the environment
+ *   of the worker.
+ */
+void submit_command(struct command *user_command) {
+
+  if (!user_command->arguments[1]) {
+    fprintf(stderr, "usage: submit cmd [args...] [< file] [> file]\n");
+    program_status.exit_status = FAILURE;
+    return;
+  }
+
+  // Render the command back into a single line
+  char entry[MAX_COMMAND_LENGTH];
+  int length = 0;
+  for (int i = 1; user_command->arguments[i]; i++) {
+    length += snprintf(entry + length, sizeof(entry) - length, "%s%s",
+                       i > 1 ? " " : "", user_command->arguments[i]);
+    if (length >= sizeof(entry))
+      break;
+  }
+  if (user_command->input_file && length < sizeof(entry))
+    length += snprintf(entry + length, sizeof(entry) - length, " < %s",
+                       user_command->input_file);
+  if (user_command->output_file && length < sizeof(entry))
+    length += snprintf(entry + length, sizeof(entry) - length, " > %s",
+                       user_command->output_file);
+  for (int i = 0; user_command->extra_output_files[i] &&
+                  length < sizeof(entry); i++)
+    length += snprintf(entry + length, sizeof(entry) - length, " > %s",
+                       user_command->extra_output_files[i]);
+  if (length >= sizeof(entry)) {
+    fprintf(stderr, "submit: command too long\n");
+    program_status.exit_status = FAILURE;
+    return;
+  }
+
+  char directory[PATH_MAX];
+  if (!getcwd(directory, sizeof(directory))) {
+    perror("submit: getcwd");
+    program_status.exit_status = FAILURE;
+    return;
+  }
+
+  struct work_queue *queue = open_work_queue();
+  if (!queue) {
+    program_status.exit_status = FAILURE;
+    return;
+  }
+
+  wait_semaphore(&queue->slots);
+  lock_work_queue(queue);
+  struct work_entry *queued = &queue->entries[queue->tail % WORK_QUEUE_SLOTS];
+  strcpy(queued->directory, directory);
+  strcpy(queued->command, entry);
+  queue->tail++;
+  pthread_mutex_unlock(&queue->lock);
+  sem_post(&queue->items);
+
+  program_status.exit_status = SUCCESS;
+}
+
+/*
+ * Function: run_worker
+ * -----------------------------------------------------------------------------
+ * Take a pointer to user_command as parameter,
+ *   and run commands pulled from the host-local work queue one at a time
+ *   in the foreground, each in the directory it was submitted from,
+ *   until an "exit" command is pulled.
+ * The number of running workers is the host-wide concurrency limit.
+ */
+void run_worker(struct command *user_command) {
+
+  struct work_queue *queue = open_work_queue();
+  if (!queue)
+    return;
+
+  struct work_entry entry;
+  while (!program_status.exit_program) {
+
+    wait_semaphore(&queue->items);
+    lock_work_queue(queue);
+    entry = queue->entries[queue->head % WORK_QUEUE_SLOTS];
+    queue->head++;
+    pthread_mutex_unlock(&queue->lock);
+    sem_post(&queue->slots);
+
+    // Redirections and relative paths resolve as in the submitting shell
+    reset_command(user_command, false);
+    if (chdir(entry.directory) == -1) {
+      fprintf(stderr, "worker: %s: %s\n", entry.directory, strerror(errno));
+    } else if (parse_command(entry.command, user_command) == SUCCESS) {
+      user_command->background = false;
+      execute_command(user_command);
+    }
+    handle_pending_signals();
+  }
+}
+
+/*
+ * Function: handle_sigalrm
+ * -----------------------------------------------------------------------------
+ * Listen for SIGALRM while waiting for a lock with a timeout.
+ * Does nothing: the signal only interrupts the blocking wait.
+ */
+void handle_sigalrm(int signal) {}
+
+/*
+ * Function: run_lock
+ * -----------------------------------------------------------------------------
+ * Takes the arguments of the lock builtin as parameter:
+ *   lock NAME [--shared] [--timeout SECONDS] -- cmd [args...]
+ * Take an flock on NAME in the lock directory ($SMALLSH_LOCK_DIR, or the
+ *   private locks directory, see open_private_directory), blocking in the
+ *   kernel until it is granted, and replace this process with cmd so the
+ *   lock is held while cmd runs. The lock file is opened with O_NOFOLLOW.
+ * Returns FAILURE if the lock cannot be taken or cmd cannot be executed.
+ */
+int run_lock(char **arguments, struct builtin_context *context) {
+
+  char *name = arguments[1];
+  int operation = LOCK_EX;
+  int timeout = 0;
+  char **locked_command = NULL;
+
+  for (int i = 2; arguments[i]; i++) {
+    if (strcmp(arguments[i], "--shared") == 0) {
+      operation = LOCK_SH;
+    } else if (strcmp(arguments[i], "--timeout") == 0 && arguments[i + 1]) {
+      timeout = atoi(arguments[++i]);
+    } else if (strcmp(arguments[i], "--") == 0) {
+      locked_command = &arguments[i + 1];
+      break;
+    } else {
+      break;
+    }
+  }
+
+  if (!name || strchr(name, '/') || !locked_command || !locked_command[0]) {
+    fprintf(stderr, "usage: lock NAME [--shared] [--timeout SECONDS] "
+                    "-- cmd [args...]\n");
+    return FAILURE;
+  }
+
+  // Open the lock file in the lock directory
+  char *lock_directory = getenv("SMALLSH_LOCK_DIR");
+  int directory_fd = lock_directory ?
+                     open(lock_directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC) :
+                     open_private_directory("locks");
+  if (directory_fd == -1) {
+    if (lock_directory)
+      perror(lock_directory);
+    return FAILURE;
+  }
+
+  int file_descriptor = openat(directory_fd, name, O_RDONLY | O_CREAT |
+                               O_NOFOLLOW, 0600);
+  close(directory_fd);
+  if (file_descriptor == -1) {
+    perror(name);
+    return FAILURE;
+  }
+
+  // The alarm interrupts the blocking flock once the timeout expires
+  if (timeout > 0) {
+    struct sigaction sa_sigalrm = {{0}};
+    sa_sigalrm.sa_handler = handle_sigalrm;
+    sigaction(SIGALRM, &sa_sigalrm, NULL);
+    alarm(timeout);
+  }
+
+  if (flock(file_descriptor, operation) == -1) {
+    if (errno == EINTR)
+      fprintf(stderr, "lock: timed out waiting for %s\n", name);
+    else
+      perror("flock");
+    return FAILURE;
+  }
+  alarm(0);
+
+  // The lock is released when the last holder of the descriptor exits
+  execvp(locked_command[0], locked_command);
+  perror(locked_command[0]);
+  return FAILURE;
+}
+
+/*
+ * Function: initialize_semaphore
+ * -----------------------------------------------------------------------------
+ * Takes a new semaphore segment and its number of permits.
+ * Initialize the process-shared semaphore with the permits.
+ */
+void initialize_semaphore(void *segment, int permits) {
+
+  struct shared_semaphore *shared = segment;
+  sem_init(&shared->semaphore, 1, permits);
+  shared->permits = permits;
+  shared->magic = SEMAPHORE_MAGIC;
+}
+
+/*
+ * Function: forward_signal
+ * -----------------------------------------------------------------------------
+ * Takes a signal number as parameter.
+ * Pass a terminating signal received by a semaphore holder on to its child,
+ *   so the holder outlives the child and can return the permit.
+ */
+void forward_signal(int signal) {
+
+  if (semaphore_child > 0)
+    kill(semaphore_child, signal);
+}
+
+/*
+ * Function: run_semaphore
+ * -----------------------------------------------------------------------------
+ * Takes the arguments of the sem builtin as parameter:
+ *   sem NAME N -- cmd [args...]
+ *   sem --remove NAME
+ * Acquire the named counting semaphore NAME, created with N permits by
+ *   its first user, run cmd and release the semaphore once cmd finishes.
+ * The semaphore lives in shared memory (see map_shared_segment) and waits
+ *   block on a futex. It keeps its N until removed with --remove, so a
+ *   different N is refused rather than silently ignored.
+ * SIGINT, SIGTERM, SIGHUP and SIGQUIT received while holding the permit are
+ *   forwarded to cmd, and the permit is returned once it has been reaped.
+ * Returns the exit value of cmd (128 + N if it was killed by signal N),
+ *   or FAILURE.
+ */
+int run_semaphore(char **arguments, struct builtin_context *context) {
+
+  if (arguments[1] && strcmp(arguments[1], "--remove") == 0 &&
+      arguments[2] && !strchr(arguments[2], '/') && !arguments[3]) {
+    char semaphore_name[NAME_MAX];
+    snprintf(semaphore_name, sizeof(semaphore_name), "/smallsh-sem-%d-%s",
+             (int)getuid(), arguments[2]);
+    if (shm_unlink(semaphore_name) == -1) {
+      perror(arguments[2]);
+      return FAILURE;
+    }
+    return SUCCESS;
+  }
+
+  char *name = arguments[1];
+  int permits = arguments[1] && arguments[2] ? atoi(arguments[2]) : 0;
+  bool valid = name && !strchr(name, '/') && permits > 0 && arguments[3] &&
+               strcmp(arguments[3], "--") == 0 && arguments[4];
+
+  if (!valid) {
+    fprintf(stderr, "usage: sem NAME N -- cmd [args...]\n"
+                    "       sem --remove NAME\n");
+    return FAILURE;
+  }
+
+  char semaphore_name[NAME_MAX];
+  snprintf(semaphore_name, sizeof(semaphore_name), "/smallsh-sem-%d-%s",
+           (int)getuid(), name);
+  struct shared_semaphore *shared = map_shared_segment(
+      semaphore_name, sizeof(struct shared_semaphore), SEMAPHORE_MAGIC,
+      initialize_semaphore, permits);
+  if (!shared)
+    return FAILURE;
+  if (shared->permits != permits) {
+    fprintf(stderr, "sem: %s has %d permits, not %d (see sem --remove)\n",
+            name, shared->permits, permits);
+    munmap(shared, sizeof(struct shared_semaphore));
+    return FAILURE;
+  }
+  sem_t *semaphore = &shared->semaphore;
+
+  // Until the child exists, a terminating signal ends the wait or is held
+  // back, so the holder never dies between taking and returning the permit
+  int forwarded[] = {SIGINT, SIGTERM, SIGHUP, SIGQUIT};
+  sigset_t forwarded_set, previous_set;
+  sigemptyset(&forwarded_set);
+  for (int i = 0; i < 4; i++)
+    sigaddset(&forwarded_set, forwarded[i]);
+
+  wait_semaphore(semaphore);
+  sigprocmask(SIG_BLOCK, &forwarded_set, &previous_set);
+
+  // Ignored signals, such as SIGINT in the background, stay ignored
+  struct sigaction sa_forward = {{0}}, sa_previous[4];
+  sa_forward.sa_handler = forward_signal;
+  sigfillset(&sa_forward.sa_mask);
+  for (int i = 0; i < 4; i++) {
+    sigaction(forwarded[i], NULL, &sa_previous[i]);
+    if (sa_previous[i].sa_handler != SIG_IGN)
+      sigaction(forwarded[i], &sa_forward, NULL);
+  }
+
+  int exit_value = FAILURE;
+  pid_t spawn_pid = fork();
+  num_forks++;
+  if (spawn_pid == 0) {
+    for (int i = 0; i < 4; i++)
+      sigaction(forwarded[i], &sa_previous[i], NULL);
+    sigprocmask(SIG_SETMASK, &previous_set, NULL);
+    execvp(arguments[4], &arguments[4]);
+    perror(arguments[4]);
+    exit(FAILURE);
+
+  } else if (spawn_pid > 0) {
+    // Signals held back since the permit was taken are delivered here
+    semaphore_child = spawn_pid;
+    sigprocmask(SIG_SETMASK, &previous_set, NULL);
+
+    int exit_method;
+    while (waitpid(spawn_pid, &exit_method, 0) == -1 && errno == EINTR) {}
+    if (WIFEXITED(exit_method))
+      exit_value = WEXITSTATUS(exit_method);
+    else if (WIFSIGNALED(exit_method))
+      exit_value = 128 + WTERMSIG(exit_method);
+  } else {
+    perror("fork() failed");
+  }
+
+  sem_post(semaphore);
+  munmap(shared, sizeof(struct shared_semaphore));
+  return exit_value;
+}
+
+/*
+ * Function: find_builtin
+ * -----------------------------------------------------------------------------
+ * Takes the arguments of a command as parameter.
+ * Returns the builtin_context builtin named by the command, or NULL if none
+ *   or if the builtin leaves these arguments to the utility it stands in for.
+ */
+const struct builtin *find_builtin(char **arguments) {
+
+  const struct registry_entry *entry = lookup_builtin(arguments[0]);
+  if (!entry || !entry->builtin || !builtin_supports(entry->builtin, arguments))
+    return NULL;
+  return entry->builtin;
+}
+
+/*
+ * Function: builtin_supports
+ * -----------------------------------------------------------------------------
+ * Takes a builtin and the arguments of a command as parameters.
+ * Returns false if the builtin stands in for a standard utility and does
+ *   not support the arguments, so the utility has to run instead.
+ */
+bool builtin_supports(const struct builtin *builtin, char **arguments) {
+
+  for (int i = 0; shadowed_utilities[i].run; i++) {
+    if (shadowed_utilities[i].run == builtin->run)
+      return shadowed_utilities[i].supported(arguments);
+  }
+  return true;
+}
+
+/*
+ * Function: hash_name
+ * -----------------------------------------------------------------------------
+ * Takes a command name and a seed.
+ * Returns the FNV-1a hash of the name, starting from a basis mixed with seed.
+ */
+unsigned long hash_name(const char *name, unsigned long seed) {
+
+  unsigned long hash = 14695981039346656037UL ^ (seed * 0x9e3779b97f4a7c15UL);
+  for (const char *current = name; *current; current++) {
+    hash ^= (unsigned char)*current;
+    hash *= 1099511628211UL;
+  }
+  return hash ^ (hash >> 29);
+}
+
+/*
+ * Function: fill_registry
+ * -----------------------------------------------------------------------------
+ * Takes a table size (a power of two) and a seed.
+ * Insert every builtin into a new table of that size using hash_name.
+ * Returns false, leaving the registry as it was, if two names collide.
+ */
+bool fill_registry(unsigned long size, unsigned long seed) {
+
+  struct registry_entry *entries = calloc(size, sizeof(struct registry_entry));
+  int num_shell = 0;
+  while (shell_builtins[num_shell].name)
+    num_shell++;
+  int num_static = 0;
+  while (builtins[num_static].name)
+    num_static++;
+  int total = num_shell + num_static + builtin_registry.num_loaded;
+
+  for (int i = 0; i < total; i++) {
+    struct registry_entry entry = {NULL, NULL, NULL};
+    if (i < num_shell) {
+      entry.shell_builtin = &shell_builtins[i];
+      entry.name = entry.shell_builtin->name;
+    } else if (i < num_shell + num_static) {
+      entry.builtin = &builtins[i - num_shell];
+      entry.name = entry.builtin->name;
+    } else {
+      entry.builtin = builtin_registry.loaded[i - num_shell - num_static];
+      entry.name = entry.builtin->name;
+    }
+
+    unsigned long index = hash_name(entry.name, seed) & (size - 1);
+    if (entries[index].name) {
+      free(entries);
+      return false;
+    }
+    entries[index] = entry;
+  }
+
+  free(builtin_registry.entries);
+  builtin_registry.entries = entries;
+  builtin_registry.size = size;
+  builtin_registry.seed = seed;
+  return true;
+}
+
+/*
+ * Function: build_registry
+ * -----------------------------------------------------------------------------
+ * Generate the perfect hash of the builtin registry: search for a seed
+ *   under which no two builtin names share a slot, growing the table when
+ *   no seed is found, so a lookup hashes once and compares once.
+ * Runs at startup and whenever enable -f loads a builtin.
+ */
+void build_registry(void) {
+
+  unsigned long size = 16;
+  while (size < 2 * (sizeof(shell_builtins) / sizeof(shell_builtins[0]) +
+                     sizeof(builtins) / sizeof(builtins[0]) +
+                     builtin_registry.num_loaded))
+    size *= 2;
+
+  for (;; size *= 2) {
+    for (unsigned long seed = 0; seed < 4096; seed++) {
+      if (fill_registry(size, seed))
+        return;
+    }
+  }
+}
+
+/*
+ * Function: lookup_builtin
+ * -----------------------------------------------------------------------------
+ * Takes a command name as parameter.
+ * Returns the registry entry of the builtin with that name, or NULL if none.
+ */
+const struct registry_entry *lookup_builtin(const char *name) {
+
+  if (!builtin_registry.entries)
+    return NULL;
+
+  const struct registry_entry *entry = &builtin_registry.entries[
+    hash_name(name, builtin_registry.seed) & (builtin_registry.size - 1)];
+  if (entry->name && strcmp(entry->name, name) == 0)
+    return entry;
+  return NULL;
+}
+
+/*
+ * Function: get_shell_variable
+ * -----------------------------------------------------------------------------
+ * Takes a variable name as parameter, for the builtin_context of builtins.
+ * Returns the value of the shell variable (its first element for an array)
+ *   or else the environment variable, NULL if neither is set.
+ */
+const char *get_shell_variable(const char *name) {
+
+  struct variable *found = find_variable(name);
+  if (found)
+    return found->num_values ? found->values[0] : "";
+  return getenv(name);
+}
+
+/*
+ * Function: set_shell_variable
+ * -----------------------------------------------------------------------------
+ * Takes a variable name and a value, for the builtin_context of builtins.
+ * Set the shell variable to a copy of the value.
+ */
+void set_shell_variable(const char *name, const char *value) {
+
+  set_variable(name, (char **)&value, 1);
+}
+
+/*
+ * Function: enable_builtin
+ * -----------------------------------------------------------------------------
+ * Take a pointer to user_command as parameter:
+ *   enable                  list the builtins
+ *   enable -f FILE NAME...  load the builtins NAME from the shared object FILE
+ * FILE exports smallsh_builtin_abi and a struct builtin named NAME_builtin
+ *   as described in builtin.h. Loaded builtins stay loaded, and their names
+ *   cannot be taken by another builtin.
+ */
+void enable_builtin(struct command *user_command) {
+
+  char **arguments = user_command->arguments;
+  program_status.exit_status = SUCCESS;
+  program_status.kill_signal = 0;
+
+  // List builtins
+  if (!arguments[1]) {
+    for (unsigned long i = 0; i < builtin_registry.size; i++) {
+      if (builtin_registry.entries[i].name)
+        printf("enable %s\n", builtin_registry.entries[i].name);
+    }
+    fflush(stdout);
+    return;
+  }
+
+  if (strcmp(arguments[1], "-f") != 0 || !arguments[2] || !arguments[3]) {
+    fprintf(stderr, "usage: enable [-f FILE NAME...]\n");
+    program_status.exit_status = FAILURE;
+    return;
+  }
+
+  void *library = dlopen(arguments[2], RTLD_NOW | RTLD_LOCAL);
+  if (!library) {
+    fprintf(stderr, "enable: %s\n", dlerror());
+    program_status.exit_status = FAILURE;
+    return;
+  }
+
+  const int *abi = dlsym(library, "smallsh_builtin_abi");
+  if (!abi || *abi != SMALLSH_BUILTIN_ABI) {
+    fprintf(stderr, "enable: %s: not built for builtin ABI %d\n",
+            arguments[2], SMALLSH_BUILTIN_ABI);
+    dlclose(library);
+    program_status.exit_status = FAILURE;
+    return;
+  }
+
+  bool loaded = false;
+  for (int i = 3; arguments[i]; i++) {
+    char symbol[MAX_VARIABLE_NAME + 16];
+    snprintf(symbol, sizeof(symbol), "%s_builtin", arguments[i]);
+    const struct builtin *builtin = dlsym(library, symbol);
+
+    if (!builtin || !builtin->name || !builtin->run ||
+        strcmp(builtin->name, arguments[i]) != 0) {
+      fprintf(stderr, "enable: %s: no builtin %s\n", arguments[2],
+              arguments[i]);
+      program_status.exit_status = FAILURE;
+    } else if (lookup_builtin(builtin->name)) {
+      fprintf(stderr, "enable: %s: already a builtin\n", builtin->name);
+      program_status.exit_status = FAILURE;
+    } else if (builtin_registry.num_loaded == MAX_LOADED_BUILTINS) {
+      fprintf(stderr, "enable: too many loaded builtins\n");
+      program_status.exit_status = FAILURE;
+    } else {
+      builtin_registry.loaded[builtin_registry.num_loaded++] = builtin;
+      loaded = true;
+    }
+  }
+
+  // The library stays open for as long as its builtins are registered
+  if (loaded)
+    build_registry();
+  else
+    dlclose(library);
+}
+
+/*
+ * Function: show_status
+ * -----------------------------------------------------------------------------
+ * Take a pointer to user_command as parameter.
+ * Report the status of the last foreground process (status builtin).
+ */
+void show_status(struct command *user_command) {
+
+  report_status();
+}
+
+/*
+ * Function: exit_shell
+ * -----------------------------------------------------------------------------
+ * Take a pointer to user_command as parameter.
+ * Make the main loop stop after this command (exit builtin).
+ */
+void exit_shell(struct command *user_command) {
+
+  program_status.exit_program = true;
+}
+
+/*
+ * Function: run_builtin
+ * -----------------------------------------------------------------------------
+ * Takes a builtin and a pointer to user_command as parameters.
+ * Run the builtin in the shell process with its redirections opened as
+ *   the input and output descriptors, and record its exit value.
+ * The shell ignores SIGINT, so while the builtin runs SIGINT cancels it
+ *   instead (see handle_builtin_sigint), and it ends as terminated by the
+ *   signal like an interrupted foreground child.
+ */
+void run_builtin(const struct builtin *builtin, struct command *user_command) {
+
+  struct builtin_context context = {AT_FDCWD, -1, -1, &builtin_cancelled,
+                                    environ, get_shell_variable,
+                                    set_shell_variable};
+  builtin_cancelled = false;
+  struct sigaction sa_cancel = {{0}}, sa_previous;
+  sa_cancel.sa_handler = handle_builtin_sigint;
+  sigfillset(&sa_cancel.sa_mask);
+  sigaction(SIGINT, &sa_cancel, &sa_previous);
+
+  context.input_fd = open_redirection(user_command, INPUT);
+  if (context.input_fd != -1)
+    context.output_fd = open_redirection(user_command, OUTPUT);
+
+  if (context.input_fd == -1 || context.output_fd == -1) {
+    program_status.exit_status = FAILURE;
+  } else {
+    program_status.exit_status = builtin->run(user_command->arguments,
+                                              &context);
+  }
+  program_status.kill_signal = 0;
+
+  sigaction(SIGINT, &sa_previous, NULL);
+  if (builtin_cancelled) {
+    program_status.kill_signal = SIGINT;
+    program_status.exit_status = 0;
+    report_status();
+  }
+
+  if (context.input_fd > STDIN_FILENO)
+    close(context.input_fd);
+  if (context.output_fd > STDOUT_FILENO)
+    close(context.output_fd);
+}
+
+/*
+ * Function: start_thread_job
+ * -----------------------------------------------------------------------------
+ * Takes a thread-safe builtin and a pointer to user_command as parameters.
+ * Queue the builtin on the thread pool as a background pseudo-job, starting
+ *   the pool threads on first use. The job owns copies of the arguments,
+ *   its redirections and a descriptor of the current working directory,
+ *   so later commands of the shell cannot affect it.
+ */
+void start_thread_job(const struct builtin *builtin,
+                      struct command *user_command) {
+
+  struct thread_job *job = calloc(1, sizeof(struct thread_job));
+  job->builtin = builtin;
+  job->context.cancelled = &job->cancelled;
+  job->context.environment = environ;
+  job->context.input_fd = open_redirection(user_command, INPUT);
+  job->context.output_fd = open_redirection(user_command, OUTPUT);
+  job->context.directory_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (job->context.input_fd == -1 || job->context.output_fd == -1 ||
+      job->context.directory_fd == -1) {
+    if (job->context.input_fd != -1)
+      close(job->context.input_fd);
+    if (job->context.output_fd != -1)
+      close(job->context.output_fd);
+    if (job->context.directory_fd != -1)
+      close(job->context.directory_fd);
+    free(job);
+    program_status.exit_status = FAILURE;
+    return;
+  }
+
+  int num_arguments = 0;
+  while (user_command->arguments[num_arguments])
+    num_arguments++;
+  job->arguments = calloc(num_arguments + 1, sizeof(char *));
+  for (int i = 0; i < num_arguments; i++)
+    job->arguments[i] = strdup(user_command->arguments[i]);
+
+  // Start the pool threads with every signal blocked,
+  //   so signals are only ever handled by the main thread
+  if (builtin_pool.num_threads == 0) {
+    sigset_t all_signals, previous_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &previous_signals);
+
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < 1 || num_threads > MAX_POOL_THREADS)
+      num_threads = MAX_POOL_THREADS;
+    for (int i = 0; i < num_threads; i++) {
+      if (pthread_create(&builtin_pool.threads[i], NULL, run_pool_thread,
+                         NULL) == 0)
+        builtin_pool.num_threads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &previous_signals, NULL);
+  }
+
+  // Add the pseudo-job to the background processes before it can finish
+  sigset_t child_signal, previous_signals;
+  sigemptyset(&child_signal);
+  sigaddset(&child_signal, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &child_signal, &previous_signals);
+
+  job->job_id = next_job_id++;
+  push_background_process(-job->job_id, job);
+  printf("background job is %d\n", job->job_id);
+  fflush(stdout);
+
+  pthread_mutex_lock(&builtin_pool.lock);
+  if (builtin_pool.tail)
+    builtin_pool.tail->next = job;
+  else
+    builtin_pool.head = job;
+  builtin_pool.tail = job;
+  pthread_cond_signal(&builtin_pool.available);
+  pthread_mutex_unlock(&builtin_pool.lock);
+
+  sigprocmask(SIG_SETMASK, &previous_signals, NULL);
+}
+
+/*
+ * Function: run_pool_thread
+ * -----------------------------------------------------------------------------
+ * Main function of a pool thread.
+ * Take jobs from the pool queue and run them, skipping cancelled ones.
+ * Once a job has finished, its descriptors are closed and SIGCHLD is
+ *   raised so the shell reports it like a finished background process.
+ */
+void *run_pool_thread(void *argument) {
+
+  while (true) {
+    pthread_mutex_lock(&builtin_pool.lock);
+    while (!builtin_pool.head)
+      pthread_cond_wait(&builtin_pool.available, &builtin_pool.lock);
+    struct thread_job *job = builtin_pool.head;
+    builtin_pool.head = job->next;
+    if (!builtin_pool.head)
+      builtin_pool.tail = NULL;
+    pthread_mutex_unlock(&builtin_pool.lock);
+
+    if (!job->cancelled)
+      job->exit_value = job->builtin->run(job->arguments, &job->context);
+
+    if (job->context.input_fd > STDIN_FILENO)
+      close(job->context.input_fd);
+    if (job->context.output_fd > STDOUT_FILENO)
+      close(job->context.output_fd);
+    close(job->context.directory_fd);
+
+    __atomic_store_n(&job->finished, true, __ATOMIC_RELEASE);
+    kill(getpid(), SIGCHLD);
+  }
+  return NULL;
+}
+
+/*
+ * Function: cancel_job
+ * -----------------------------------------------------------------------------
+ * Take a pointer to user_command as parameter, and ask the background
+ *   builtin with the job id given after "cancel" to stop.
+ * Queued jobs never start; running builtins stop at their next check.
+ */
+void cancel_job(struct command *user_command) {
+
+  char *job_argument = user_command->arguments[1];
+  int job_id = job_argument ? atoi(job_argument) : 0;
+
+  struct process *current_background_process = program_status.background;
+  while (current_background_process) {
+    if (current_background_process->thread_job &&
+        current_background_process->thread_job->job_id == job_id) {
+      current_background_process->thread_job->cancelled = true;
+      program_status.exit_status = SUCCESS;
+      return;
+    }
+    current_background_process = current_background_process->next;
+  }
+
+  fprintf(stderr, "cancel: no such background job: %s\n",
+          job_argument ? job_argument : "");
+  program_status.exit_status = FAILURE;
+}
+
+/*
+ * Function: open_private_directory
+ * -----------------------------------------------------------------------------
+ * Takes the name of a directory of the shell as parameter.
+ * Open smallsh-NAME in $XDG_RUNTIME_DIR, or /tmp/smallsh-NAME-UID without
+ *   it, creating the directory if needed. As anyone may have created it
+ *   first in /tmp, it is only used if it is not a symbolic link, belongs to
+ *   the user and is not accessible by other users.
+ * Returns a descriptor of the directory, or -1 after printing an error.
+ */
+int open_private_directory(const char *name) {
+
+  char path[PATH_MAX];
+  char *runtime_directory = getenv("XDG_RUNTIME_DIR");
+  if (runtime_directory && runtime_directory[0] == '/')
+    snprintf(path, sizeof(path), "%s/smallsh-%s", runtime_directory, name);
+  else
+    snprintf(path, sizeof(path), "/tmp/smallsh-%s-%d", name, (int)getuid());
+
+  if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+    perror(path);
+    return -1;
+  }
+
+  struct stat directory_status;
+  int directory_fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                                O_CLOEXEC);
+  if (directory_fd == -1 || fstat(directory_fd, &directory_status) == -1) {
+    perror(path);
+    if (directory_fd != -1)
+      close(directory_fd);
+    return -1;
+  }
+  if (directory_status.st_uid != getuid() ||
+      (directory_status.st_mode & 077) != 0) {
+    fprintf(stderr, "%s: not a private directory of the user\n", path);
+    close(directory_fd);
+    return -1;
+  }
+  return directory_fd;
+}
+
+/*
+ * Function: hash_job_identity
+ * -----------------------------------------------------------------------------
+ * Takes the command of a once job as parameter.
+ * Returns the FNV-1a hash of everything that makes two jobs identical:
+ *   the arguments, the working directory, the environment and the file
+ *   the job reads as input.
+ */
+unsigned long hash_job_identity(char **job_command) {
+
+  unsigned long hash = 14695981039346656037UL;
+  char working_directory[PATH_MAX] = "";
+  getcwd(working_directory, sizeof(working_directory));
+  struct stat input_status = {0};
+  fstat(STDIN_FILENO, &input_status);
+  char input_identity[64];
+  snprintf(input_identity, sizeof(input_identity), "%lu:%lu",
+           (unsigned long)input_status.st_dev,
+           (unsigned long)input_status.st_ino);
+
+  // Each string is hashed with its terminating zero as a separator
+  const char *fixed[] = {working_directory, input_identity, NULL};
+  char **lists[] = {job_command, (char **)fixed, environ};
+  for (int list = 0; list < 3; list++) {
+    for (int i = 0; lists[list] && lists[list][i]; i++) {
+      const char *current = lists[list][i];
+      do {
+        hash ^= (unsigned char)*current;
+        hash *= 1099511628211UL;
+      } while (*current++);
+    }
+    hash ^= list;
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+/*
+ * Function: read_once_result
+ * -----------------------------------------------------------------------------
+ * Takes the descriptor to copy the output of a finished once job to, and
+ *   the result file of the job.
+ * The result file holds a header of ONCE_HEADER_LENGTH bytes, "exit N" once
+ *   the job has finished, followed by the captured output of the job.
+ * Returns the exit value of the job, or FAILURE if it did not finish.
+ */
+int read_once_result(int output_fd, int result_fd) {
+
+  char header[ONCE_HEADER_LENGTH + 1] = "";
+  if (pread(result_fd, header, ONCE_HEADER_LENGTH, 0) != ONCE_HEADER_LENGTH ||
+      strncmp(header, "exit ", 5) != 0) {
+    fprintf(stderr, "once: the job did not finish\n");
+    return FAILURE;
+  }
+
+  char buffer[READ_CHUNK_SIZE * 8];
+  ssize_t num_bytes;
+  off_t offset = ONCE_HEADER_LENGTH;
+  while ((num_bytes = pread(result_fd, buffer, sizeof(buffer), offset)) > 0) {
+    write_all(output_fd, buffer, num_bytes);
+    offset += num_bytes;
+  }
+  return atoi(header + 5);
+}
+
+/*
+ * Function: run_once
+ * -----------------------------------------------------------------------------
+ * Takes the arguments of the once builtin as parameter:
+ *   once cmd [args...]
+ * Run cmd unless an identical job (same arguments, working directory,
+ *   environment and input, see hash_job_identity) is already running on the
+ *   host, in which case attach to it instead of starting a duplicate.
+ * Jobs of a kind take turns on an exclusive flock on KEY.lock in the private
+ *   once directory (see open_private_directory) to look for KEY.out. The
+ *   first job, the leader, creates KEY.out and holds an exclusive flock on it
+ *   while cmd runs, capturing the output of cmd behind a header that receives
+ *   the exit value when cmd finishes. Attached jobs open KEY.out, block on a
+ *   shared flock of it until the leader is done, then print the same output
+ *   and return the same exit value. An unlocked KEY.out without an exit
+ *   value was left by a leader that died, and is replaced.
+ * The leader removes both files when cmd finishes, so a lock taken on a
+ *   removed KEY.lock is dropped and retried.
+ * Files are opened without following symbolic links.
+ * Returns the exit value of cmd (128 + N if it was killed by signal N).
+ */
+int run_once(char **arguments, struct builtin_context *context) {
+
+  char **job_command = &arguments[1];
+  if (!job_command[0]) {
+    fprintf(stderr, "usage: once cmd [args...]\n");
+    return FAILURE;
+  }
+
+  int directory_fd = open_private_directory("once");
+  if (directory_fd == -1)
+    return FAILURE;
+
+  char lock_name[32], result_name[32];
+  unsigned long key = hash_job_identity(job_command);
+  snprintf(lock_name, sizeof(lock_name), "%016lx.lock", key);
+  snprintf(result_name, sizeof(result_name), "%016lx.out", key);
+
+  int lock_fd;
+  while (true) {
+    lock_fd = openat(directory_fd, lock_name,
+                     O_RDONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (lock_fd == -1) {
+      perror(lock_name);
+      return FAILURE;
+    }
+    while (flock(lock_fd, LOCK_EX) == -1 && errno == EINTR)
+      continue;
+
+    // Retry unless the lock file was removed by the previous leader
+    struct stat locked_status, current_status;
+    if (fstat(lock_fd, &locked_status) == 0 &&
+        fstatat(directory_fd, lock_name, &current_status,
+                AT_SYMLINK_NOFOLLOW) == 0 &&
+        locked_status.st_dev == current_status.st_dev &&
+        locked_status.st_ino == current_status.st_ino)
+      break;
+    close(lock_fd);
+  }
+
+  // Attach to the running leader, which holds its result file locked
+  int result_fd = openat(directory_fd, result_name,
+                         O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (result_fd != -1) {
+    if (flock(result_fd, LOCK_SH | LOCK_NB) == -1) {
+      close(lock_fd);
+      while (flock(result_fd, LOCK_SH) == -1 && errno == EINTR)
+        continue;
+      int exit_value = read_once_result(context->output_fd, result_fd);
+      close(result_fd);
+      return exit_value;
+    }
+
+    // Left by a leader that died before finishing
+    close(result_fd);
+    unlinkat(directory_fd, result_name, 0);
+  }
+
+  // Leader: lock the result file before other jobs can look for it
+  result_fd = openat(directory_fd, result_name,
+                     O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (result_fd == -1) {
+    perror(result_name);
+    close(lock_fd);
+    return FAILURE;
+  }
+  flock(result_fd, LOCK_EX);
+  char header[ONCE_HEADER_LENGTH];
+  memset(header, ' ', sizeof(header));
+  header[ONCE_HEADER_LENGTH - 1] = '\n';
+  pwrite(result_fd, header, sizeof(header), 0);
+  flock(lock_fd, LOCK_UN);
+
+  pid_t pid = fork();
+  num_forks++;
+  if (pid == 0) {
+    int output_fd = openat(directory_fd, result_name,
+                           O_WRONLY | O_APPEND | O_NOFOLLOW);
+    dup2(output_fd, STDOUT_FILENO);
+    execvp(job_command[0], job_command);
+    perror(job_command[0]);
+    exit(FAILURE);
+  }
+
+  int exit_method = 0;
+  int exit_value = FAILURE;
+  while (pid > 0 && waitpid(pid, &exit_method, 0) == -1 && errno == EINTR)
+    continue;
+  if (pid > 0 && WIFEXITED(exit_method))
+    exit_value = WEXITSTATUS(exit_method);
+  else if (pid > 0 && WIFSIGNALED(exit_method))
+    exit_value = 128 + WTERMSIG(exit_method);
+
+  // Publish the exit value, then remove the files before attached jobs
+  // are let in, so later jobs run cmd again
+  int length = snprintf(header, sizeof(header), "exit %d", exit_value);
+  memset(header + length, ' ', sizeof(header) - length - 1);
+  pwrite(result_fd, header, sizeof(header), 0);
+  while (flock(lock_fd, LOCK_EX) == -1 && errno == EINTR)
+    continue;
+  unlinkat(directory_fd, result_name, 0);
+  unlinkat(directory_fd, lock_name, 0);
+  flock(result_fd, LOCK_UN);
+  close(lock_fd);
+
+  exit_value = read_once_result(context->output_fd, result_fd);
+  close(result_fd);
+  return exit_value;
+}
+
+/*
+ * Function: run_mkdir
+ * -----------------------------------------------------------------------------
+ * Takes the arguments of the mkdir builtin and its context as parameters:
+ *   mkdir [-p] DIRECTORY...
+ * Create each directory, and with -p its missing parents, ignoring
+ *   directories that exist already. Other options run /bin/mkdir instead.
+ * Thread-safe: paths are resolved against context->directory_fd only,
+ *   and errors are written with a single write each.
+ * Returns FAILURE if any directory could not be created.
+ */
+int run_mkdir(char **arguments, struct builtin_context *context) {
+
+  bool parents = false;
+  int exit_value = SUCCESS;
+  int first_path = 1;
+
+  if (arguments[1] && strcmp(arguments[1], "-p") == 0) {
+    parents = true;
+    first_path = 2;
+  }
+
+  if (!arguments[first_path]) {
+    dprintf(STDERR_FILENO, "mkdir: missing operand\n");
+    return FAILURE;
+  }
+
+  for (int i = first_path; arguments[i]; i++) {
+    if (context->cancelled && *context->cancelled)
+      return FAILURE;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", arguments[i]);
+
+    // Create missing parents one component at a time
+    if (parents) {
+      for (char *separator = strchr(path + 1, '/'); separator;
+           separator = strchr(separator + 1, '/')) {
+        *separator = '\0';
+        mkdirat(context->directory_fd, path, 0777);
+        *separator = '/';
+      }
+    }
+
+    if (mkdirat(context->directory_fd, path, 0777) == -1) {
+      // With -p, only an existing directory counts as created
+      int error = errno;
+      struct stat file_status;
+      if (parents && error == EEXIST &&
+          fstatat(context->directory_fd, path, &file_status, 0) == 0 &&
+          S_ISDIR(file_status.st_mode))
+        continue;
+      dprintf(STDERR_FILENO, "mkdir: cannot create directory '%s': %s\n",
+              arguments[i], strerror(error));
+      exit_value = FAILURE;
+    }
+  }
+
+  return exit_value;
+}
+
+/*
+ * Function: mkdir_supported
+ * -----------------------------------------------------------------------------
+ * Takes the arguments of the mkdir builtin as parameter.
+ * Returns whether the only option is a leading -p.
+ */
+bool mkdir_supported(char **arguments) {
+
+  for (int i = 1; arguments[i]; i++) {
+    if (arguments[i][0] == '-' && !(i == 1 && strcmp(arguments[i], "-p") == 0))
+      return false;
+  }
+  return true;
+}
+
+/*
+ * Function: copy_file
+ * -----------------------------------------------------------------------------
+ * Takes the source and target paths of a copy and the builtin context
+ *   they are resolved in as parameters.
+ * Copy the regular file source to target, created with the permissions of
+ *   source or truncated, with copy_file_range so the kernel moves the data,
+ *   or in blocks of COPY_BUFFER_SIZE bytes across file systems.
+ * Returns FAILURE if the file could not be copied.
+ */
+int copy_file(const char *source, const char *target,
+              struct builtin_context *context) {
+
+  struct stat source_status, target_status;
+  int source_fd = openat(context->directory_fd, source, O_RDONLY | O_CLOEXEC);
+  if (source_fd == -1 || fstat(source_fd, &source_status) == -1) {
+    dprintf(STDERR_FILENO, "cp: cannot stat '%s': %s\n", source,
+            strerror(errno));
+    if (source_fd != -1)
+      close(source_fd);
+    return FAILURE;
+  }
+  if (S_ISDIR(source_status.st_mode)) {
+    dprintf(STDERR_FILENO, "cp: -r not specified; omitting directory '%s'\n",
+            source);
+    close(source_fd);
+    return FAILURE;
+  }
+  if (fstatat(context->directory_fd, target, &target_status, 0) == 0 &&
+      target_status.st_dev == source_status.st_dev &&
+      target_status.st_ino == source_status.st_ino) {
+    dprintf(STDERR_FILENO, "cp: '%s' and '%s' are the same file\n", source,
+            target);
+    close(source_fd);
+    return FAILURE;
+  }
+
+  int target_fd = openat(context->directory_fd, target,
+                         O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                         source_status.st_mode & 07777);
+  if (target_fd == -1) {
+    dprintf(STDERR_FILENO, "cp: cannot create regular file '%s': %s\n",
+            target, strerror(errno));
+    close(source_fd);
+    return FAILURE;
+  }
+
+  bool use_buffer = false;
+  char *buffer = NULL;
+  ssize_t num_bytes;
+  do {
+    if (context->cancelled && *context->cancelled) {
+      num_bytes = -1;
+      errno = ECANCELED;
+      break;
+    }
+
+    if (!use_buffer) {
+      num_bytes = copy_file_range(source_fd, NULL, target_fd, NULL,
+                                  COPY_BUFFER_SIZE, 0);
+      if (num_bytes == -1 && (errno == EXDEV || errno == EINVAL ||
+                              errno == ENOSYS || errno == EOPNOTSUPP)) {
+        use_buffer = true;
+        num_bytes = 1;
+      }
+    } else {
+      if (!buffer && !(buffer = malloc(COPY_BUFFER_SIZE)))
+        num_bytes = -1;
+      else if ((num_bytes = read(source_fd, buffer, COPY_BUFFER_SIZE)) > 0 &&
+               !write_all(target_fd, buffer, num_bytes))
+        num_bytes = -1;
+    }
+  } while (num_bytes > 0 || (num_bytes == -1 && errno == EINTR));
+
+  if (num_bytes == -1)
+    dprintf(STDERR_FILENO, "cp: error copying '%s' to '%s': %s\n", source,
+            target, strerror(errno));
+  free(buffer);
+  close(source_fd);
+  if (close(target_fd) == -1 && num_bytes == 0) {
+    dprintf(STDERR_FILENO, "cp: error writing '%s': %s\n", target,
+            strerror(errno));
+    num_bytes = -1;
+  }
+  return num_bytes == 0 ? SUCCESS : FAILURE;
+}
+
+/*
+ * Function: run_cp
+ * -----------------------------------------------------------------------------
+ * Takes the arguments of the cp builtin and its context as parameters:
+ *   cp SOURCE TARGET
+ *   cp SOURCE... DIRECTORY
+ * Copy the regular file SOURCE to TARGET, or each SOURCE into DIRECTORY
+ *   under its own name. Options run /bin/cp instead.
+ * Thread-safe: paths are resolved against context->directory_fd only,
+ *   the copy checks context->cancelled between blocks and errors are
+ *   written with a single write each.
+ * Returns FAILURE if any file could not be copied.
+ */
+int run_cp(char **arguments, struct builtin_context *context) {
+
+  int num_operands = 0;
+  while (arguments[num_operands + 1])
+    num_operands++;
+
+  if (num_operands == 0) {
+    dprintf(STDERR_FILENO, "cp: missing file operand\n");
+    return FAILURE;
+  } else if (num_operands == 1) {
+    dprintf(STDERR_FILENO, "cp: missing destination file operand after "
+                           "'%s'\n", arguments[1]);
+    return FAILURE;
+  }
+
+  char *target = arguments[num_operands];
+  struct stat target_status;
+  bool into_directory = fstatat(context->directory_fd, target,
+                                &target_status, 0) == 0 &&
+                        S_ISDIR(target_status.st_mode);
+  if (!into_directory) {
+    if (num_operands == 2)
+      return copy_file(arguments[1], target, context);
+    dprintf(STDERR_FILENO, "cp: target '%s' is not a directory\n", target);
+    return FAILURE;
+  }
+
+  int exit_value = SUCCESS;
+  for (int i = 1; i < num_operands; i++) {
+    char *name = strrchr(arguments[i], '/');
+    name = name ? name + 1 : arguments[i];
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", target, name);
+    if (copy_file(arguments[i], path, context) == FAILURE)
+      exit_value = FAILURE;
+  }
+  return exit_value;
+}
+
+/*
+ * Function: cp_supported
+ * -----------------------------------------------------------------------------
+ * Takes the arguments of the cp builtin as parameter.
+ * Returns whether they are all file operands, without options.
+ */
+bool cp_supported(char **arguments) {
+
+  for (int i = 1; arguments[i]; i++) {
+    if (arguments[i][0] == '-')
+      return false;
+  }
+  return true;
+}
+
+/*
+ * Function: run_fields
+ * -----------------------------------------------------------------------------
+ * Takes the arguments of the fields builtin and its context as parameters:
+ *   fields [-d DELIMITER] LIST
+ * Print the fields of each input line selected by LIST, a comma separated
+ *   list of 1-based fields and ranges such as 1,3-5,7-, in field order.
+ * Fields are separated by runs of blanks, leading blanks ignored, and
+ *   printed separated by a space. With -d they are separated by each
+ *   DELIMITER character, found with memchr, and printed separated by it.
+ * Input is read and output written in blocks of FIELDS_BUFFER_SIZE bytes,
+ *   and fields are copied from the input block straight into the output
+ *   block. Scanning a line stops after its last selected field.
+ * Thread-safe: only context->input_fd and context->output_fd are used.
+ * Returns FAILURE on an invalid LIST or a read or write error.
+ */
+int run_fields(char **arguments, struct builtin_context *context) {
+
+  char delimiter = '\0';
+  int first_list = 1;
+  if (arguments[1] && strcmp(arguments[1], "-d") == 0 && arguments[2] &&
+      strlen(arguments[2]) == 1) {
+    delimiter = arguments[2][0];
+    first_list = 3;
+  }
+
+  // Fields up to max_field are looked up, fields from open_from all selected
+  char *list = arguments[first_list];
+  bool *selected = NULL;
+  int max_field = 0;
+  int open_from = INT_MAX;
+  bool valid = list && *list && !arguments[first_list + 1];
+  for (char *range = list; valid && *range; ) {
+    char *end = range;
+    long first = isdigit((unsigned char)*range) ? strtol(range, &end, 10) : 0;
+    long last = first;
+    if (*end == '-') {
+      first = end == range ? 1 : first;
+      last = INT_MAX;
+      if (isdigit((unsigned char)*++end))
+        last = strtol(end, &end, 10);
+    }
+    valid = first >= 1 && last >= first && (*end == ',' || *end == '\0');
+    range = *end ? end + 1 : end;
+    if (!valid)
+      break;
+
+    if (last == INT_MAX) {
+      open_from = first < open_from ? first : open_from;
+    } else if (last > max_field) {
+      selected = realloc(selected, (last + 1) * sizeof(bool));
+      memset(selected + max_field + 1, 0, (last - max_field) * sizeof(bool));
+      max_field = last;
+    }
+    for (long field = first; field <= last && field <= max_field; field++)
+      selected[field] = true;
+  }
+  if (!valid) {
+    dprintf(STDERR_FILENO, "usage: fields [-d DELIMITER] LIST\n");
+    free(selected);
+    return FAILURE;
+  }
+  int last_needed = open_from == INT_MAX ? max_field : INT_MAX;
+
+  struct byte_buffer input = {malloc(FIELDS_BUFFER_SIZE), 0,
+                              FIELDS_BUFFER_SIZE};
+  struct byte_buffer output = {NULL, 0, 0};
+  char separator = delimiter ? delimiter : ' ';
+  bool end_of_input = false;
+  int exit_value = SUCCESS;
+
+  while (!end_of_input && exit_value == SUCCESS) {
+    if (context->cancelled && *context->cancelled) {
+      exit_value = FAILURE;
+      break;
+    }
+
+    // Fill the block, growing it for a line longer than the block
+    if (input.length == input.capacity) {
+      input.capacity *= 2;
+      input.data = realloc(input.data, input.capacity);
+    }
+    ssize_t num_bytes = read(context->input_fd, input.data + input.length,
+                             input.capacity - input.length);
+    if (num_bytes == -1) {
+      if (errno == EINTR)
+        continue;
+      exit_value = FAILURE;
+      break;
+    }
+    input.length += num_bytes;
+    end_of_input = num_bytes == 0;
+
+    // Complete lines, and the last line at the end of the input
+    char *line = input.data;
+    char *data_end = input.data + input.length;
+    while (line < data_end) {
+      char *line_end = memchr(line, '\n', data_end - line);
+      if (!line_end && !end_of_input)
+        break;
+      if (!line_end)
+        line_end = data_end;
+
+      bool first_output = true;
+      char *field_start = line;
+      for (int field = 1; field <= last_needed; field++) {
+        char *field_end;
+        if (delimiter) {
+          field_end = memchr(field_start, delimiter, line_end - field_start);
+          if (!field_end)
+            field_end = line_end;
+        } else {
+          while (field_start < line_end &&
+                 (*field_start == ' ' || *field_start == '\t'))
+            field_start++;
+          if (field_start == line_end)
+            break;
+          field_end = field_start;
+          while (field_end < line_end && *field_end != ' ' &&
+                 *field_end != '\t')
+            field_end++;
+        }
+
+        if (field >= open_from || (field <= max_field && selected[field])) {
+          if (!first_output)
+            append_buffer(&output, &separator, 1);
+          append_buffer(&output, field_start, field_end - field_start);
+          first_output = false;
+        }
+        if (field_end == line_end)
+          break;
+        field_start = field_end + 1;
+      }
+      append_buffer(&output, "\n", 1);
+      line = line_end + 1;
+    }
+    consume_buffer(&input, line < data_end ? line - input.data : input.length);
+
+    if (output.length >= FIELDS_BUFFER_SIZE || end_of_input) {
+      if (!write_all(context->output_fd, output.data, output.length))
+        exit_value = FAILURE;
+      output.length = 0;
+    }
+  }
+
+  free(input.data);
+  free(output.data);
+  free(selected);
+  return exit_value;
+}
+
+/*
+ * Function: load_timezone
+ * -----------------------------------------------------------------------------
+ * Load the timezone data once for the whole shell, so formatting a local
+ *   time does not read it again.
+ */
+void load_timezone(void) {
+
+  static pthread_once_t timezone_once = PTHREAD_ONCE_INIT;
+  pthread_once(&timezone_once, tzset);
+}
+
+/*
+ * Function: format_time
+ * -----------------------------------------------------------------------------
+ * Takes a buffer and its size, a strftime format, a time and whether it is
+ *   formatted in UTC as parameters.
+ * Format the time as strftime does, with %N for the nanoseconds as well,
+ *   and UTC as the name of the UTC timezone as the date command does.
+ * Thread-safe.
+ * Returns the length of the formatted time, 0 if it does not fit.
+ */
+size_t format_time(char *buffer, size_t size, const char *format,
+                   const struct timespec *time, bool utc) {
+
+  load_timezone();
+  struct tm broken_down;
+  if (utc)
+    gmtime_r(&time->tv_sec, &broken_down);
+  else
+    localtime_r(&time->tv_sec, &broken_down);
+
+  // Replace %N, which strftime does not know, and %Z in UTC before formatting
+  char expanded[MAX_MESSAGE_LENGTH];
+  size_t length = 0;
+  for (const char *current = format; *current; current++) {
+    if (length + 10 >= sizeof(expanded))
+      return 0;
+    if (current[0] == '%' && current[1] == 'N') {
+      length += snprintf(expanded + length, sizeof(expanded) - length,
+                         "%09ld", time->tv_nsec);
+      current++;
+    } else if (utc && current[0] == '%' && current[1] == 'Z') {
+      length += snprintf(expanded + length, sizeof(expanded) - length, "UTC");
+      current++;
+    } else {
+      if (current[0] == '%' && current[1] == '%')
+        expanded[length++] = *current++;
+      expanded[length++] = *current;
+    }
+  }
+  expanded[length] = '\0';
+
+  return strftime(buffer, size, expanded, &broken_down);
+}
+
+/*
+ * Function: dynamic_variable
+ * -----------------------------------------------------------------------------
+ * Takes a variable name and a buffer of 32 bytes as parameters.
+ * Returns the value of the variables computed when they are expanded,
+ *   written into the buffer, or NULL for any other name:
+ *   EPOCHSECONDS - seconds since the epoch
+ *   EPOCHREALTIME - seconds since the epoch with microseconds
+ * The time is read with clock_gettime, through the vDSO without a system
+ *   call.
+ */
+char *dynamic_variable(const char *name, char *buffer) {
+
+  bool seconds = strcmp(name, "EPOCHSECONDS") == 0;
+  if (!seconds && strcmp(name, "EPOCHREALTIME") != 0)
+    return NULL;
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (seconds)
+    snprintf(buffer, 32, "%ld", (long) now.tv_sec);
+  else
+    snprintf(buffer, 32, "%ld.%06ld", (long) now.tv_sec, now.tv_nsec / 1000);
+  return buffer;
+}
+
+/*
+ * Function: run_date
+ * -----------------------------------------------------------------------------
+ * Takes the arguments of the date builtin and its context as parameters:
+ *   date [-u] [-d @SECONDS] [+FORMAT]
+ * Print the current time, or the given time since the epoch, in the strftime
+ *   FORMAT (see format_time), by default as the date command does in the
+ *   C locale. With -u the time is printed in UTC.
+ * Other options and conversions run /bin/date instead (see date_supported).
+ * Thread-safe: output is written to context->output_fd only.
+ * Returns FAILURE on invalid arguments.
+ */
+int run_date(char **arguments, struct builtin_context *context) {
+
+  const char *format = "%a %b %e %H:%M:%S %Z %Y";
+  bool utc = false;
+  struct timespec time;
+  clock_gettime(CLOCK_REALTIME, &time);
+
+  for (int i = 1; arguments[i]; i++) {
+    char *end = NULL;
+    if (strcmp(arguments[i], "-u") == 0) {
+      utc = true;
+    } else if (strcmp(arguments[i], "-d") == 0 && arguments[i + 1] &&
+               arguments[i + 1][0] == '@') {
+      time.tv_sec = strtol(arguments[++i] + 1, &end, 10);
+      time.tv_nsec = 0;
+    } else if (arguments[i][0] == '+') {
+      format = arguments[i] + 1;
+    } else {
+      end = arguments[i];
+    }
+    if (end && *end) {
+      dprintf(STDERR_FILENO, "usage: date [-u] [-d @SECONDS] [+FORMAT]\n");
+      return FAILURE;
+    }
+  }
+
+  char date[MAX_MESSAGE_LENGTH];
+  size_t length = format_time(date, sizeof(date) - 1, format, &time, utc);
+  date[length++] = '\n';
+  return write_all(context->output_fd, date, length) ? SUCCESS : FAILURE;
+}
+
+/*
+ * Function: date_supported
+ * -----------------------------------------------------------------------------
+ * Takes the arguments of the date builtin as parameter.
+ * Returns whether they are only -u, -d @SECONDS and a single +FORMAT of
+ *   strftime conversions without flags or widths.
+ */
+bool date_supported(char **arguments) {
+
+  bool has_format = false;
+  for (int i = 1; arguments[i]; i++) {
+    char *end = NULL;
+    if (strcmp(arguments[i], "-u") == 0)
+      continue;
+
+    if (strcmp(arguments[i], "-d") == 0 && arguments[i + 1] &&
+        arguments[i + 1][0] == '@') {
+      strtol(arguments[++i] + 1, &end, 10);
+      if (*end || end == arguments[i] + 1)
+        return false;
+
+    } else if (arguments[i][0] == '+' && !has_format) {
+      has_format = true;
+      for (char *current = arguments[i] + 1; *current; current++) {
+        if (*current == '%' &&
+            (!*++current ||
+             !strchr("aAbBcCdDeFgGhHIjklmMnNpPrRsStTuUVwWxXyYzZ%", *current)))
+          return false;
+      }
+
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Function: run_printf
+ * -----------------------------------------------------------------------------
+ * Takes the arguments of the printf builtin and its context as parameters:
+ *   printf FORMAT [ARGUMENT...]
+ * Print the arguments in FORMAT, which may contain the escapes \n, \t and
+ *   \\ and the conversions
+ *   %s - the argument
+ *   %d - the argument as an integer
+ *   %(TIME_FORMAT)T - the argument, seconds since the epoch or -1 for now,
+ *                     as a local time in TIME_FORMAT (see format_time)
+ *   %% - a percent sign
+ *   The format is reused while arguments remain. Other escapes, flags,
+ *   widths and conversions run /usr/bin/printf instead (see
+ *   printf_supported). Like it, %d takes decimal, octal (0) and hexadecimal
+ *   (0x) numbers and reports other values, printed as far as they convert.
+ * Thread-safe: output is written to context->output_fd only.
+ * Returns FAILURE on an invalid format or number.
+ */
+int run_printf(char **arguments, struct builtin_context *context) {
+
+  char *format = arguments[1];
+  if (!format) {
+    dprintf(STDERR_FILENO, "usage: printf FORMAT [ARGUMENT...]\n");
+    return FAILURE;
+  }
+
+  struct byte_buffer output = {NULL, 0, 0};
+  char **argument = arguments + 2;
+  int exit_value = SUCCESS;
+  bool invalid_number = false;
+
+  do {
+    char **first_argument = argument;
+    for (char *current = format; *current && exit_value == SUCCESS;
+         current++) {
+
+      if (*current == '\\' && current[1]) {
+        char *escape = strchr("n\nt\t\\\\", *++current);
+        char character = escape && (escape - "n\nt\t\\\\") % 2 == 0 ?
+                         escape[1] : *current;
+        append_buffer(&output, &character, 1);
+        continue;
+      }
+      if (*current != '%') {
+        append_buffer(&output, current, 1);
+        continue;
+      }
+
+      char *value = *argument ? *argument : "";
+      char conversion = *++current;
+      if (conversion == '%') {
+        append_buffer(&output, "%", 1);
+
+      } else if (conversion == 's') {
+        append_buffer(&output, value, strlen(value));
+
+      } else if (conversion == 'd') {
+        char number[32], *end;
+        append_buffer(&output, number,
+                      format_integer(number, sizeof(number),
+                                     strtol(value, &end, 0)));
+        if (*end) {
+          dprintf(STDERR_FILENO, "printf: '%s': %s\n", value,
+                  end == value ? "expected a numeric value" :
+                                 "value not completely converted");
+          invalid_number = true;
+        }
+
+      } else if (conversion == '(' && strstr(current, ")T")) {
+        char *time_end = strstr(current, ")T");
+        char time_format[MAX_MESSAGE_LENGTH];
+        snprintf(time_format, sizeof(time_format), "%.*s",
+                 (int)(time_end - current - 1), current + 1);
+        struct timespec time;
+        clock_gettime(CLOCK_REALTIME, &time);
+        if (*value && strcmp(value, "-1") != 0) {
+          time.tv_sec = strtol(value, NULL, 10);
+          time.tv_nsec = 0;
+        }
+        char formatted[MAX_MESSAGE_LENGTH];
+        append_buffer(&output, formatted,
+                      format_time(formatted, sizeof(formatted), time_format,
+                                  &time, false));
+        current = time_end + 1;
+
+      } else {
+        dprintf(STDERR_FILENO, "printf: invalid conversion %%%c\n",
+                conversion ? conversion : ' ');
+        exit_value = FAILURE;
+        break;
+      }
+
+      if (conversion != '%' && *argument)
+        argument++;
+    }
+
+    // Stop reusing the format once it consumes no arguments
+    if (argument == first_argument)
+      break;
+  } while (*argument && exit_value == SUCCESS);
+
+  if (output.length > 0 && !write_all(context->output_fd, output.data,
+                                      output.length))
+    exit_value = FAILURE;
+  free(output.data);
+  return invalid_number ? FAILURE : exit_value;
+}
+
+/*
+ * Function: printf_supported
+ * -----------------------------------------------------------------------------
+ * Takes the arguments of the printf builtin as parameter.
+ * Returns whether the format only has the escapes and conversions that
+ *   run_printf supports, without flags or widths, and is not an option.
+ */
+bool printf_supported(char **arguments) {
+
+  char *format = arguments[1];
+  if (!format)
+    return true;
+  if (format[0] == '-')
+    return false;
+
+  for (char *current = format; *current; current++) {
+    if (*current == '\\' && current[1]) {
+      if (!strchr("nt\\", *++current))
+        return false;
+    } else if (*current == '%') {
+      current++;
+      if (*current == '(' && strstr(current, ")T"))
+        current = strstr(current, ")T") + 1;
+      else if (!*current || !strchr("sd%", *current))
+        return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Function: compare_walk_value
+ * -----------------------------------------------------------------------------
+ * Takes a comparison of a walk filter, a value and a limit as parameters.
+ * Returns true if the value is larger than ('+'), smaller than ('-') or
+ *   equal to ('=') the limit, or if there is no comparison ('\0').
+ */
+bool compare_walk_value(char comparison, long long value, long long limit) {
+
+  return comparison == '\0' || (comparison == '+' && value > limit) ||
+         (comparison == '-' && value < limit) ||
+         (comparison == '=' && value == limit);
+}
+
+/*
+ * Function: walk_selects
+ * -----------------------------------------------------------------------------
+ * Takes a walk filter, a file name and its type as parameters, and
+ *   the directory and name to find the file status with if it is needed.
+ * The cheap conditions on the name and type are checked first, so the file
+ *   is only examined with fstatat for its size or age when they hold.
+ * Returns true if the file meets the conditions of the filter.
+ */
+bool walk_selects(struct walk_filter *filter, const char *name, char type,
+                  int directory_fd, const char *path) {
+
+  if (filter->name && fnmatch(filter->name, name, 0) != 0)
+    return false;
+  if (filter->type && filter->type != type)
+    return false;
+  if (!filter->size_comparison && !filter->age_comparison)
+    return true;
+
+  struct stat file_status;
+  if (fstatat(directory_fd, path, &file_status, AT_SYMLINK_NOFOLLOW) == -1)
+    return false;
+  long long age = (filter->now - file_status.st_mtime) / 86400;
+  return compare_walk_value(filter->size_comparison, file_status.st_size,
+                            filter->size) &&
+         compare_walk_value(filter->age_comparison, age, filter->age);
+}
+
+/*
+ * Function: add_walk_path
+ * -----------------------------------------------------------------------------
+ * Takes the walk state, a selected path and its length as parameters.
+ * Add the path to the batch for the command, queueing the batch once the
+ *   path would take it over the argument size limit.
+ * Called with state->lock held.
+ */
+void add_walk_path(struct walk_state *state, const char *path, size_t length) {
+
+  size_t path_length = length + 1 + sizeof(char *);
+  if (state->num_batch_paths > 0 &&
+      state->batch_length + path_length > state->batch_limit) {
+    state->ready = realloc(state->ready, (state->num_ready + 1) *
+                                         sizeof(char **));
+    state->ready[state->num_ready++] = state->batch;
+    state->batch = NULL;
+    state->num_batch_paths = 0;
+    state->batch_length = 0;
+    pthread_cond_broadcast(&state->changed);
+  }
+
+  state->batch = realloc(state->batch, (state->num_batch_paths + 2) *
+                                       sizeof(char *));
+  state->batch[state->num_batch_paths++] = strndup(path, length);
+  state->batch[state->num_batch_paths] = NULL;
+  state->batch_length += path_length;
+}
+
+/*
+ * Function: read_walk_directory
+ * -----------------------------------------------------------------------------
+ * Takes the walk state, the path of a directory and the output buffer of
+ *   the thread as parameters.
+ * Read the directory with getdents64 through a descriptor from openat,
+ *   queue its subdirectories and batch its selected entries, or print them
+ *   in blocks of WALK_BUFFER_SIZE bytes. Symbolic links are not followed.
+ */
+void read_walk_directory(struct walk_state *state, const char *path,
+                         struct byte_buffer *output) {
+
+  int directory_fd = openat(state->directory_fd, path,
+                            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (directory_fd == -1) {
+    dprintf(STDERR_FILENO, "walk: %s: %s\n", path, strerror(errno));
+    pthread_mutex_lock(&state->lock);
+    state->exit_value = FAILURE;
+    pthread_mutex_unlock(&state->lock);
+    return;
+  }
+
+  struct byte_buffer entry_path = {NULL, 0, 0};
+  size_t path_length = strlen(path);
+  append_buffer(&entry_path, path, path_length);
+  if (path_length == 0 || path[path_length - 1] != '/')
+    append_buffer(&entry_path, "/", 1);
+  size_t prefix_length = entry_path.length;
+
+  char entries[WALK_BUFFER_SIZE];
+  long num_bytes;
+  while ((num_bytes = syscall(SYS_getdents64, directory_fd, entries,
+                              sizeof(entries))) > 0) {
+    for (long offset = 0; offset < num_bytes; ) {
+      struct linux_dirent64 *entry = (struct linux_dirent64 *)
+                                     (entries + offset);
+      offset += entry->d_reclen;
+      char *name = entry->d_name;
+      if (name[0] == '.' && (name[1] == '\0' ||
+                             (name[1] == '.' && name[2] == '\0')))
+        continue;
+
+      char type = entry->d_type == DT_DIR ? 'd' :
+                  entry->d_type == DT_REG ? 'f' :
+                  entry->d_type == DT_LNK ? 'l' : 'o';
+      struct stat file_status;
+      if (entry->d_type == DT_UNKNOWN &&
+          fstatat(directory_fd, name, &file_status,
+                  AT_SYMLINK_NOFOLLOW) == 0) {
+        type = S_ISDIR(file_status.st_mode) ? 'd' :
+               S_ISREG(file_status.st_mode) ? 'f' :
+               S_ISLNK(file_status.st_mode) ? 'l' : 'o';
+      }
+
+      entry_path.length = prefix_length;
+      append_buffer(&entry_path, name, strlen(name) + 1);
+
+      if (type == 'd') {
+        pthread_mutex_lock(&state->lock);
+        if (state->num_directories == state->directories_capacity) {
+          state->directories_capacity = state->directories_capacity * 2 + 16;
+          state->directories = realloc(state->directories,
+                                       state->directories_capacity *
+                                       sizeof(char *));
+        }
+        state->directories[state->num_directories++] =
+          strdup(entry_path.data);
+        pthread_cond_broadcast(&state->changed);
+        pthread_mutex_unlock(&state->lock);
+      }
+
+      if (!walk_selects(&state->filter, name, type, directory_fd, name))
+        continue;
+
+      if (state->batch_limit) {
+        pthread_mutex_lock(&state->lock);
+        add_walk_path(state, entry_path.data, entry_path.length - 1);
+        pthread_mutex_unlock(&state->lock);
+      } else {
+        entry_path.data[entry_path.length - 1] = '\n';
+        append_buffer(output, entry_path.data, entry_path.length);
+        if (output->length >= WALK_BUFFER_SIZE) {
+          pthread_mutex_lock(&state->output_lock);
+          write_all(state->output_fd, output->data, output->length);
+          pthread_mutex_unlock(&state->output_lock);
+          output->length = 0;
+        }
+      }
+    }
+  }
+  if (num_bytes == -1)
+    dprintf(STDERR_FILENO, "walk: %s: %s\n", path, strerror(errno));
+
+  close(directory_fd);
+  free(entry_path.data);
+}
+
+/*
+ * Function: run_walk_thread
+ * -----------------------------------------------------------------------------
+ * Takes the walk state as parameter.
+ * Read directories from the stack until every directory has been read.
+ */
+void *run_walk_thread(void *argument) {
+
+  struct walk_state *state = argument;
+  struct byte_buffer output = {NULL, 0, 0};
+
+  pthread_mutex_lock(&state->lock);
+  while (true) {
+    while (state->num_directories == 0 && state->num_busy > 0)
+      pthread_cond_wait(&state->changed, &state->lock);
+
+    // Finished once no directory is queued or being read
+    if (state->num_directories == 0) {
+      state->finished = true;
+      pthread_cond_broadcast(&state->changed);
+      break;
+    }
+
+    char *path = state->directories[--state->num_directories];
+    state->num_busy++;
+    pthread_mutex_unlock(&state->lock);
+
+    read_walk_directory(state, path, &output);
+    free(path);
+
+    pthread_mutex_lock(&state->lock);
+    state->num_busy--;
+  }
+  pthread_mutex_unlock(&state->lock);
+
+  pthread_mutex_lock(&state->output_lock);
+  write_all(state->output_fd, output.data, output.length);
+  pthread_mutex_unlock(&state->output_lock);
+  free(output.data);
+  return NULL;
+}
+
+/*
+ * Function: start_walk_batch
+ * -----------------------------------------------------------------------------
+ * Takes the command and its resolved path, and a batch of paths as
+ *   parameters.
+ * Start the command with the paths appended to its arguments.
+ * Only execv runs between fork and exec, as the walking threads keep
+ *   running in the parent.
+ * Returns the id of the process, or -1 if it could not be started.
+ */
+pid_t start_walk_batch(char **command, const char *path, char **batch) {
+
+  int num_command = 0;
+  while (command[num_command])
+    num_command++;
+  int num_paths = 0;
+  while (batch[num_paths])
+    num_paths++;
+
+  char **arguments = calloc(num_command + num_paths + 1, sizeof(char *));
+  memcpy(arguments, command, num_command * sizeof(char *));
+  memcpy(arguments + num_command, batch, num_paths * sizeof(char *));
+
+  pid_t spawn_pid = fork();
+  num_forks++;
+  if (spawn_pid == 0) {
+    execv(path, arguments);
+    _exit(127);
+  }
+  if (spawn_pid == -1)
+    perror("fork() failed");
+
+  free(arguments);
+  for (int i = 0; i < num_paths; i++)
+    free(batch[i]);
+  free(batch);
+  return spawn_pid;
+}
+
+/*
+ * Function: wait_walk_batch
+ * -----------------------------------------------------------------------------
+ * Takes the number of running commands and the exit value so far as
+ *   parameters.
+ * Wait for a command of the walk builtin to finish, releasing the
+ *   jobserver token it ran on.
+ * Returns the exit value of the command if it is the first to fail,
+ *   otherwise the exit value so far.
+ */
+int wait_walk_batch(int *running, int exit_value) {
+
+  int exit_method;
+  pid_t pid;
+  while ((pid = waitpid(-1, &exit_method, 0)) == -1 && errno == EINTR)
+    ;
+  if (pid == -1) {
+    *running = 0;
+    return exit_value;
+  }
+
+  (*running)--;
+  if (*running > 0 && jobserver.size > 0)
+    release_job_token();
+  if (exit_value == SUCCESS &&
+      (!WIFEXITED(exit_method) || WEXITSTATUS(exit_method) != 0))
+    exit_value = WIFEXITED(exit_method) ? WEXITSTATUS(exit_method) : FAILURE;
+  return exit_value;
+}
+
+/*
+ * Function: run_walk
+ * -----------------------------------------------------------------------------
+ * Takes the arguments of the walk builtin and its context as parameters:
+ *   walk [DIRECTORY...] [-name PATTERN] [-type f|d|l] [-size [+-]N[kMG]]
+ *        [-mtime [+-]N] [-j N] [-exec COMMAND [ARGUMENT...]]
+ * Walk the directory trees (the current directory by default) on threads
+ *   reading directories in parallel, and select the paths meeting every
+ *   condition: a file name matching PATTERN, a type, a size in bytes and
+ *   an age in days since modification larger (+), smaller (-) or equal.
+ * Print the selected paths, in no particular order, or run COMMAND with
+ *   them appended as arguments, in batches as large as the argument size
+ *   limit allows. At most N commands (-j, the number of processors by
+ *   default) run at once, and batches beyond the first run on jobserver
+ *   tokens like pfor iterations.
+ * Returns FAILURE if a directory could not be read, or the exit value of
+ *   the first failed command.
+ */
+int run_walk(char **arguments, struct builtin_context *context) {
+
+  struct walk_state state = {PTHREAD_MUTEX_INITIALIZER,
+                             PTHREAD_COND_INITIALIZER};
+  state.filter.now = time(NULL);
+  state.directory_fd = context->directory_fd;
+  state.output_fd = context->output_fd;
+  pthread_mutex_init(&state.output_lock, NULL);
+  int max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  char **command = NULL;
+  bool valid = true;
+
+  char **roots = calloc(MAX_ARGS, sizeof(char *));
+  int num_roots = 0;
+  for (int i = 1; arguments[i] && valid; i++) {
+    char *option = arguments[i];
+    char *value = arguments[i + 1];
+    char *end = NULL;
+
+    if (strcmp(option, "-exec") == 0 && value) {
+      command = arguments + i + 1;
+      break;
+    } else if (option[0] != '-') {
+      roots[num_roots++] = option;
+      continue;
+    } else if (!value) {
+      valid = false;
+      break;
+    }
+
+    i++;
+    if (strcmp(option, "-name") == 0) {
+      state.filter.name = value;
+    } else if (strcmp(option, "-type") == 0) {
+      state.filter.type = value[0];
+      valid = strchr("fdl", value[0]) && value[0] && !value[1];
+    } else if (strcmp(option, "-size") == 0 || strcmp(option, "-mtime") == 0) {
+      char comparison = strchr("+-", value[0]) && value[0] ? value[0] : '=';
+      long long limit = strtoll(value + (comparison != '='), &end, 10);
+      if (option[1] == 's') {
+        const char *units = "kMG";
+        char *unit = *end ? strchr(units, *end) : NULL;
+        for (int j = 0; unit && j <= unit - units; j++)
+          limit *= 1024;
+        end += unit != NULL;
+        state.filter.size_comparison = comparison;
+        state.filter.size = limit;
+      } else {
+        state.filter.age_comparison = comparison;
+        state.filter.age = limit;
+      }
+      valid = end != value + (comparison != '=') && *end == '\0';
+    } else if (strcmp(option, "-j") == 0) {
+      max_jobs = strtol(value, &end, 10);
+      valid = max_jobs > 0 && *end == '\0';
+    } else {
+      valid = false;
+    }
+  }
+
+  const char *path = command ? resolve_command(command[0]) : NULL;
+  if (!valid || (command && !command[0])) {
+    dprintf(STDERR_FILENO, "usage: walk [DIRECTORY...] [-name PATTERN] "
+            "[-type f|d|l] [-size [+-]N[kMG]] [-mtime [+-]N] [-j N] "
+            "[-exec COMMAND [ARGUMENT...]]\n");
+    free(roots);
+    return FAILURE;
+  }
+  if (command && !path) {
+    dprintf(STDERR_FILENO, "walk: %s: not found\n", command[0]);
+    free(roots);
+    return FAILURE;
+  }
+
+  // Batches leave room for the environment and the command, as xargs does
+  if (command) {
+    size_t used = 2048;
+    for (char **variable = context->environment; *variable; variable++)
+      used += strlen(*variable) + 1 + sizeof(char *);
+    for (char **word = command; *word; word++)
+      used += strlen(*word) + 1 + sizeof(char *);
+    long arg_max = sysconf(_SC_ARG_MAX);
+    state.batch_limit = arg_max > (long) used * 2 ? arg_max - used : used;
+  }
+
+  // The trees themselves may be selected too
+  if (num_roots == 0)
+    roots[num_roots++] = ".";
+  for (int i = 0; i < num_roots; i++) {
+    struct stat root_status;
+    if (fstatat(context->directory_fd, roots[i], &root_status, 0) == -1) {
+      dprintf(STDERR_FILENO, "walk: %s: %s\n", roots[i], strerror(errno));
+      state.exit_value = FAILURE;
+      continue;
+    }
+    char *name = strrchr(roots[i], '/');
+    name = name && name[1] ? name + 1 : roots[i];
+    char type = S_ISDIR(root_status.st_mode) ? 'd' :
+                S_ISREG(root_status.st_mode) ? 'f' : 'o';
+    if (walk_selects(&state.filter, name, type, context->directory_fd,
+                     roots[i])) {
+      if (command)
+        add_walk_path(&state, roots[i], strlen(roots[i]));
+      else
+        dprintf(context->output_fd, "%s\n", roots[i]);
+    }
+    if (type == 'd') {
+      state.directories = realloc(state.directories,
+                                  (state.num_directories + 1) *
+                                  sizeof(char *));
+      state.directories[state.num_directories++] = strdup(roots[i]);
+      state.directories_capacity = state.num_directories;
+    }
+  }
+  free(roots);
+
+  int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  num_threads = num_threads < MAX_WALK_THREADS ? num_threads
+                                                : MAX_WALK_THREADS;
+  pthread_t threads[MAX_WALK_THREADS];
+  for (int i = 0; i < num_threads; i++)
+    pthread_create(&threads[i], NULL, run_walk_thread, &state);
+
+  // Run the batches as they fill up, with at most max_jobs commands at once
+  int running = 0;
+  int exit_value = SUCCESS;
+  while (command) {
+    pthread_mutex_lock(&state.lock);
+    while (state.num_ready == 0 && !state.finished)
+      pthread_cond_wait(&state.changed, &state.lock);
+    char **batch = NULL;
+    if (state.num_ready > 0) {
+      batch = state.ready[0];
+      memmove(state.ready, state.ready + 1,
+              --state.num_ready * sizeof(char **));
+    } else if (state.num_batch_paths > 0) {
+      batch = state.batch;
+      state.batch = NULL;
+      state.num_batch_paths = 0;
+    }
+    pthread_mutex_unlock(&state.lock);
+    if (!batch)
+      break;
+
+    // Batches beyond the first run on jobserver tokens
+    while (running >= max_jobs ||
+           (running > 0 && jobserver.size > 0 && !try_job_token()))
+      exit_value = wait_walk_batch(&running, exit_value);
+    if (start_walk_batch(command, path, batch) != -1)
+      running++;
+    else if (running > 0 && jobserver.size > 0)
+      release_job_token();
+  }
+
+  for (int i = 0; i < num_threads; i++)
+    pthread_join(threads[i], NULL);
+
+  while (running > 0)
+    exit_value = wait_walk_batch(&running, exit_value);
+
+  free(state.directories);
+  free(state.ready);
+  return exit_value != SUCCESS ? exit_value : state.exit_value;
+}
+
+/*
+ * Function: set_pipe_size
+ * -----------------------------------------------------------------------------
+ * Takes a pipe file descriptor and a capacity in bytes as parameters.
+ * Resize the pipe buffer with F_SETPIPE_SZ, if a capacity is given.
+ * Larger pipes let pipeline stages run longer between context switches.
+ */
+void set_pipe_size(int file_descriptor, int capacity) {
+
+  if (capacity > 0)
+    fcntl(file_descriptor, F_SETPIPE_SZ, capacity);
+}
+
+/*
+ * Function: drain_pipe
+ * -----------------------------------------------------------------------------
+ * Takes a pipe file descriptor, an output file descriptor and the number of
+ *   bytes to move as parameters.
+ * Move the bytes from the pipe to the output with splice(2), or with
+ *   read and write if the output does not support splicing.
+ * Returns false if the bytes could not be moved.
+ */
+bool drain_pipe(int pipe_fd, int output_fd, size_t length) {
+
+  char chunk[SHARD_BATCH_SIZE];
+
+  while (length > 0) {
+    ssize_t num_bytes = splice(pipe_fd, NULL, output_fd, NULL, length,
+                               SPLICE_F_MOVE);
+    if (num_bytes == -1 && errno == EINTR)
+      continue;
+
+    // Copy through user space if the output cannot be spliced into
+    if (num_bytes == -1 && errno == EINVAL) {
+      num_bytes = read(pipe_fd, chunk, length < sizeof(chunk) ?
+                       length : sizeof(chunk));
+      if (num_bytes > 0 && !write_all(output_fd, chunk, num_bytes))
+        return false;
+    }
+    if (num_bytes <= 0)
+      return false;
+    length -= num_bytes;
+  }
+  return true;
+}
+
+/*
+ * Function: relay_tee
+ * -----------------------------------------------------------------------------
+ * Takes an input file descriptor, an array of output file descriptors and
+ *   the number of outputs as parameters.
+ * Copy everything from the input to every output until the end of input.
+ * If the input is a pipe, the data is duplicated into one intermediate pipe
+ *   per extra output with tee(2) and moved on with splice(2), so it is never
+ *   copied through user space. Other inputs are copied with read and write.
+ * Returns false if an output could not be written.
+ */
+bool relay_tee(int input_fd, int *output_fds, int num_outputs) {
+
+  struct stat input_info;
+  int pipe_capacity = fcntl(input_fd, F_GETPIPE_SZ);
+  bool zero_copy = fstat(input_fd, &input_info) == 0 &&
+                   S_ISFIFO(input_info.st_mode) && pipe_capacity > 0;
+
+  // Intermediate pipes as large as the input, so a tee is never cut short
+  int middle_pipes[MAX_OUTPUT_FILES][2];
+  for (int i = 0; zero_copy && i < num_outputs - 1; i++) {
+    if (pipe2(middle_pipes[i], O_CLOEXEC) == -1) {
+      for (int j = 0; j < i; j++) {
+        close(middle_pipes[j][0]);
+        close(middle_pipes[j][1]);
+      }
+      zero_copy = false;
+      break;
+    }
+    set_pipe_size(middle_pipes[i][1], pipe_capacity);
+  }
+
+  bool success = true;
+  char chunk[SHARD_BATCH_SIZE];
+  while (success) {
+
+    if (!zero_copy) {
+      ssize_t num_bytes = read(input_fd, chunk, sizeof(chunk));
+      if (num_bytes == -1 && errno == EINTR)
+        continue;
+      if (num_bytes <= 0)
+        break;
+      for (int i = 0; i < num_outputs; i++)
+        success = write_all(output_fds[i], chunk, num_bytes) && success;
+      continue;
+    }
+
+    // Duplicate the pending input into every intermediate pipe
+    ssize_t length = num_outputs > 1 ?
+                     tee(input_fd, middle_pipes[0][1], pipe_capacity, 0) :
+                     splice(input_fd, NULL, output_fds[0], NULL,
+                            pipe_capacity, SPLICE_F_MOVE);
+    if (length == -1 && errno == EINTR)
+      continue;
+    if (length == -1 && errno == EINVAL && num_outputs == 1) {
+      zero_copy = false;
+      continue;
+    }
+    if (length <= 0) {
+      success = length == 0;
+      break;
+    }
+    if (num_outputs == 1)
+      continue;
+
+    for (int i = 1; i < num_outputs - 1 && success; i++) {
+      ssize_t duplicated;
+      while ((duplicated = tee(input_fd, middle_pipes[i][1], length, 0)) == -1
+             && errno == EINTR) {}
+      success = duplicated == length;
+    }
+
+    // The last output takes the input itself, the others their duplicates
+    for (int i = 0; i < num_outputs - 1 && success; i++)
+      success = drain_pipe(middle_pipes[i][0], output_fds[i], length);
+    success = success && drain_pipe(input_fd, output_fds[num_outputs - 1],
+                                    length);
+  }
+
+  for (int i = 0; zero_copy && i < num_outputs - 1; i++) {
+    close(middle_pipes[i][0]);
+    close(middle_pipes[i][1]);
+  }
+  return success;
+}
+
+/*
+ * Function: redirect_multios
+ * -----------------------------------------------------------------------------
+ * Takes the user command as parameter, when it has several output files.
+ * Open every output file and connect stdout of the command to a pipe.
+ * This process becomes the relay copying the pipe into every file with
+ *   relay_tee, while a new child process returns to run the command.
+ *   The relay exits with the status of the command once the pipe closes.
+ * Returns true in the command process, false if the redirection failed.
+ */
+bool redirect_multios(struct command *user_command) {
+
+  int output_fds[MAX_OUTPUT_FILES + 1];
+  int num_outputs = 0;
+  char *filename = user_command->output_file;
+
+  while (filename) {
+    output_fds[num_outputs] = open(filename, O_WRONLY | O_CREAT | O_TRUNC |
+                                   O_CLOEXEC, 0644);
+    if (output_fds[num_outputs] == -1) {
+      printf("cannot open %s for output\n", filename);
+      fflush(stdout);
+      return false;
+    }
+    filename = user_command->extra_output_files[num_outputs++];
+  }
+
+  int relay_pipe[2];
+  if (pipe2(relay_pipe, O_CLOEXEC) == -1) {
+    perror("pipe");
+    return false;
+  }
+  set_pipe_size(relay_pipe[1], program_status.pipe_size);
+
+  pid_t spawn_pid = fork();
+  num_forks++;
+  if (spawn_pid == -1) {
+    perror("fork() failed");
+    return false;
+  }
+
+  // Command process
+  if (spawn_pid == 0) {
+    dup2(relay_pipe[1], STDOUT_FILENO);
+    return true;
+  }
+
+  // Relay process
+  close(relay_pipe[1]);
+  signal(SIGPIPE, SIG_IGN);
+  relay_tee(relay_pipe[0], output_fds, num_outputs);
+  close(relay_pipe[0]);
+
+  int exit_method;
+  while (waitpid(spawn_pid, &exit_method, 0) == -1 && errno == EINTR) {}
+  if (WIFSIGNALED(exit_method)) {
+    signal(WTERMSIG(exit_method), SIG_DFL);
+    kill(getpid(), WTERMSIG(exit_method));
+  }
+  exit(WIFEXITED(exit_method) ? WEXITSTATUS(exit_method) : FAILURE);
+}
+
+/*
+ * Function: run_tee
+ * -----------------------------------------------------------------------------
+ * Takes the arguments of the tee builtin and its context as parameters:
+ *   tee [-a] FILE...
+ * Copy stdin to stdout and to every FILE, appending with -a, zero-copy
+ *   through relay_tee when stdin is a pipe.
+ * Returns FAILURE if a file cannot be opened or written.
+ */
+int run_tee(char **arguments, struct builtin_context *context) {
+
+  int flags = O_WRONLY | O_CREAT | O_CLOEXEC | O_TRUNC;
+  int first_file = 1;
+  if (arguments[1] && strcmp(arguments[1], "-a") == 0) {
+    flags = O_WRONLY | O_CREAT | O_CLOEXEC | O_APPEND;
+    first_file = 2;
+  }
+
+  int output_fds[MAX_OUTPUT_FILES + 1];
+  int num_outputs = 0;
+  output_fds[num_outputs++] = context->output_fd;
+
+  for (int i = first_file; arguments[i]; i++) {
+    if (num_outputs > MAX_OUTPUT_FILES) {
+      fprintf(stderr, "tee: too many files\n");
+      return FAILURE;
+    }
+    output_fds[num_outputs] = open(arguments[i], flags, 0644);
+    if (output_fds[num_outputs] == -1) {
+      perror(arguments[i]);
+      return FAILURE;
+    }
+    num_outputs++;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  return relay_tee(context->input_fd, output_fds, num_outputs) ? SUCCESS
+                                                               : FAILURE;
+}
+
+/*
+ * Function: set_option
+ * -----------------------------------------------------------------------------
+ * Take a pointer to user_command as parameter, and set or list
+ *   shell options:
+ *   set -o pipesize=BYTES - capacity of the pipes created by the shell
+ *   set +o pipesize - use the default pipe capacity of the system
+ *   set -o jobs=N - run a jobserver with N slots for background jobs, pfor
+ *                   and make-compatible tools started by the shell
+ *   set +o jobs - stop the jobserver
+ *   set -o autoparallel - run independent consecutive commands of a script
+ *                         concurrently (see run_parallel_block)
+ *   set +o autoparallel - run every command in turn (default)
+ *   set -b, set -o notify - report finished background jobs right away
+ *   set +b, set +o notify - report them before the next prompt (default)
+ *   set -o - list the options
+ */
+void set_option(struct command *user_command) {
+
+  char *flag = user_command->arguments[1];
+  char *option = flag ? user_command->arguments[2] : NULL;
+  program_status.exit_status = SUCCESS;
+
+  if (!flag || (strcmp(flag, "-o") == 0 && !option)) {
+    printf("pipesize %d\n", program_status.pipe_size);
+    printf("notify %s\n", program_status.notify ? "on" : "off");
+    printf("jobs %d\n", jobserver.size);
+    printf("autoparallel %s\n", program_status.autoparallel ? "on" : "off");
+    printf("nocasematch %s\n", program_status.nocasematch ? "on" : "off");
+    fflush(stdout);
+
+  } else if (strcmp(flag, "-o") == 0 && strncmp(option, "jobs=", 5) == 0 &&
+             atoi(option + 5) > 0) {
+    if (!start_jobserver(atoi(option + 5))) {
+      perror("set: jobserver");
+      program_status.exit_status = FAILURE;
+    }
+
+  } else if (strcmp(flag, "+o") == 0 && option && strcmp(option, "jobs") == 0) {
+    stop_jobserver();
+
+  } else if ((strcmp(flag, "-o") == 0 || strcmp(flag, "+o") == 0) &&
+             option && strcmp(option, "autoparallel") == 0) {
+    program_status.autoparallel = flag[0] == '-';
+
+  } else if ((strcmp(flag, "-o") == 0 || strcmp(flag, "+o") == 0) &&
+             option && strcmp(option, "nocasematch") == 0) {
+    program_status.nocasematch = flag[0] == '-';
+
+  } else if (strcmp(flag, "-b") == 0 || strcmp(flag, "+b") == 0 ||
+             ((strcmp(flag, "-o") == 0 || strcmp(flag, "+o") == 0) &&
+              option && strcmp(option, "notify") == 0)) {
+    program_status.notify = flag[0] == '-';
+    if (program_status.notify)
+      flush_notifications();
+
+  } else if (strcmp(flag, "-o") == 0 &&
+             strncmp(option, "pipesize=", 9) == 0 && atoi(option + 9) > 0) {
+    program_status.pipe_size = atoi(option + 9);
+
+  } else if (strcmp(flag, "+o") == 0 && option &&
+             strcmp(option, "pipesize") == 0) {
+    program_status.pipe_size = 0;
+
+  } else {
+    fprintf(stderr, "set: invalid option: %s%s%s\n", flag, option ? " " : "",
+            option ? option : "");
+    program_status.exit_status = FAILURE;
+  }
+}
+
+/*
+ * Function: read_proc_file
+ * -----------------------------------------------------------------------------
+ * Takes a file descriptor of a /proc file, a buffer and its size.
+ * Read the current contents of the file from its start with pread,
+ *   so the file is opened once and re-read without seeking.
+ * Returns the number of bytes read, or -1 if the process is gone.
+ */
+ssize_t read_proc_file(int file_descriptor, char *buffer, size_t size) {
+
+  if (file_descriptor == -1)
+    return -1;
+
+  ssize_t num_bytes = pread(file_descriptor, buffer, size - 1, 0);
+  buffer[num_bytes > 0 ? num_bytes : 0] = '\0';
+  return num_bytes;
+}
+
+/*
+ * Function: track_process
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to the top state, a process id and the job it belongs to.
+ * Start tracking the process, opening its /proc files once,
+ *   unless it is tracked already.
+ */
+void track_process(struct top_state *state, pid_t process_id, int job_index) {
+
+  for (int i = 0; i < state->num_processes; i++) {
+    if (state->processes[i].process_id == process_id) {
+      state->processes[i].alive = true;
+      return;
+    }
+  }
+
+  if (state->num_processes == state->capacity) {
+    state->capacity = state->capacity ? state->capacity * 2 : 16;
+    state->processes = realloc(state->processes,
+                               state->capacity * sizeof(struct top_process));
+  }
+
+  struct top_process *process = &state->processes[state->num_processes++];
+  memset(process, 0, sizeof(*process));
+  process->process_id = process_id;
+  process->job_index = job_index;
+  process->alive = true;
+  process->first_sample = true;
+
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)process_id);
+  process->stat_fd = open(path, O_RDONLY | O_CLOEXEC);
+  snprintf(path, sizeof(path), "/proc/%d/statm", (int)process_id);
+  process->statm_fd = open(path, O_RDONLY | O_CLOEXEC);
+  snprintf(path, sizeof(path), "/proc/%d/io", (int)process_id);
+  process->io_fd = open(path, O_RDONLY | O_CLOEXEC);
+  snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int)process_id,
+           (int)process_id);
+  process->children_fd = open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/*
+ * Function: sample_process
+ * -----------------------------------------------------------------------------
+ * Takes a pointer to the top state and the index of a tracked process.
+ * Re-read the /proc files of the process, updating its CPU time,
+ *   resident memory and I/O counters, and track its children.
+ * Returns false if the process has exited.
+ */
+bool sample_process(struct top_state *state, int index) {
+
+  char buffer[4096];
+  struct top_process *process = &state->processes[index];
+
+  // CPU time from stat, skipping the command name in parentheses
+  if (read_proc_file(process->stat_fd, buffer, sizeof(buffer)) <= 0)
+    return false;
+  char *fields = strrchr(buffer, ')');
+  char process_state;
+  unsigned long long user_ticks, system_ticks;
+  if (!fields || sscanf(fields + 1, " %c %*d %*d %*d %*d %*d %*u %*u %*u %*u "
+                        "%*u %llu %llu", &process_state, &user_ticks,
+                        &system_ticks) != 3 || process_state == 'Z')
+    return false;
+
+  process->previous_ticks = process->ticks;
+  process->ticks = user_ticks + system_ticks;
+
+  unsigned long resident_pages = 0;
+  if (read_proc_file(process->statm_fd, buffer, sizeof(buffer)) > 0)
+    sscanf(buffer, "%*u %lu", &resident_pages);
+  process->resident_bytes = resident_pages * state->page_size;
+
+  // I/O counters, unreadable for processes of other users
+  process->previous_read = process->read_bytes;
+  process->previous_written = process->written_bytes;
+  if (read_proc_file(process->io_fd, buffer, sizeof(buffer)) > 0) {
+    char *counter;
+    if ((counter = strstr(buffer, "rchar: ")))
+      process->read_bytes = strtoull(counter + 7, NULL, 10);
+    if ((counter = strstr(buffer, "wchar: ")))
+      process->written_bytes = strtoull(counter + 7, NULL, 10);
+  }
+
+  if (process->first_sample) {
+    process->previous_ticks = process->ticks;
+    process->previous_read = process->read_bytes;
+    process->previous_written = process->written_bytes;
+    process->first_sample = false;
+  }
+
+  // Descendants count towards the job
+  int job_index = process->job_index;
+  if (read_proc_file(process->children_fd, buffer, sizeof(buffer)) > 0) {
+    char *save_ptr;
+    for (char *child = strtok_r(buffer, " \n", &save_ptr); child;
+         child = strtok_r(NULL, " \n", &save_ptr))
+      track_process(state, atoi(child), job_index);
+  }
   return true;
-}
\ No newline at end of file
+}
+
+/*
+ * Function: format_bytes
+ * -----------------------------------------------------------------------------
+ * Takes a number of bytes, a buffer and its size as parameters.
+ * Write the number in a human readable form with a K, M or G suffix.
+ */
+void format_bytes(double bytes, char *buffer, size_t size) {
+
+  const char *suffixes = " KMG";
+  int suffix = 0;
+  while (bytes >= 1024 && suffix < 3) {
+    bytes /= 1024;
+    suffix++;
+  }
+  if (suffix == 0)
+    snprintf(buffer, size, "%.0f", bytes);
+  else
+    snprintf(buffer, size, "%.1f%c", bytes, suffixes[suffix]);
+}
+
+/*
+ * Function: show_top
+ * -----------------------------------------------------------------------------
+ * Takes the job process ids, the number of jobs, the refresh interval in
+ *   seconds and the number of refreshes (0 for no limit) as parameters.
+ * Show CPU%, RSS and read/write rates of every job and its descendants,
+ *   refreshing in place on a terminal, until every job has finished.
+ * Every /proc file is opened once per process and re-read with pread.
+ */
+int show_top(pid_t *jobs, int num_jobs, double interval, int count) {
+
+  struct top_state state = {NULL, 0, 0, sysconf(_SC_PAGESIZE)};
+  double ticks_per_second = sysconf(_SC_CLK_TCK);
+  bool terminal = isatty(STDOUT_FILENO);
+  int lines_shown = 0;
+  struct timespec delay = {(time_t)interval,
+                           (long)((interval - (time_t)interval) * 1e9)};
+
+  for (int i = 0; i < num_jobs; i++)
+    track_process(&state, jobs[i], i);
+
+  for (int refresh = 0; count == 0 || refresh < count; refresh++) {
+    if (refresh > 0)
+      nanosleep(&delay, NULL);
+
+    // Sample every process, forgetting the ones that have exited.
+    // Children found while sampling are appended and sampled in this pass.
+    for (int i = 0; i < state.num_processes; i++) {
+      if (!sample_process(&state, i)) {
+        struct top_process *process = &state.processes[i];
+        close(process->stat_fd);
+        close(process->statm_fd);
+        close(process->io_fd);
+        close(process->children_fd);
+        state.processes[i--] = state.processes[--state.num_processes];
+      }
+    }
+
+    struct byte_buffer screen = {NULL, 0, 0};
+    char line[160];
+    int length;
+
+    // Move back over the previous refresh
+    if (terminal && lines_shown > 0) {
+      length = snprintf(line, sizeof(line), "\033[%dA\033[J", lines_shown);
+      append_buffer(&screen, line, length);
+    }
+    length = snprintf(line, sizeof(line), "%8s %6s %7s %9s %9s %9s\n", "PID",
+                      "PROCS", "CPU%", "RSS", "READ/s", "WRITE/s");
+    append_buffer(&screen, line, length);
+    lines_shown = 1;
+
+    int jobs_alive = 0;
+    for (int job = 0; job < num_jobs; job++) {
+      int num_processes = 0;
+      double cpu_ticks = 0, resident = 0, read_bytes = 0, written_bytes = 0;
+      for (int i = 0; i < state.num_processes; i++) {
+        struct top_process *process = &state.processes[i];
+        if (process->job_index != job)
+          continue;
+        num_processes++;
+        cpu_ticks += process->ticks - process->previous_ticks;
+        resident += process->resident_bytes;
+        read_bytes += process->read_bytes - process->previous_read;
+        written_bytes += process->written_bytes - process->previous_written;
+      }
+      if (num_processes == 0)
+        continue;
+      jobs_alive++;
+
+      char resident_text[16], read_text[16], written_text[16];
+      double elapsed = refresh > 0 ? interval : 1;
+      format_bytes(resident, resident_text, sizeof(resident_text));
+      format_bytes(read_bytes / elapsed, read_text, sizeof(read_text));
+      format_bytes(written_bytes / elapsed, written_text, sizeof(written_text));
+      length = snprintf(line, sizeof(line), "%8d %6d %7.1f %9s %9s %9s\n",
+                        (int)jobs[job], num_processes,
+                        100 * cpu_ticks / ticks_per_second / elapsed,
+                        resident_text, read_text, written_text);
+      append_buffer(&screen, line, length);
+      lines_shown++;
+    }
+
+    // One write per refresh
+    write_all(STDOUT_FILENO, screen.data, screen.length);
+    free(screen.data);
+
+    if (jobs_alive == 0)
+      break;
+  }
+
+  for (int i = 0; i < state.num_processes; i++) {
+    close(state.processes[i].stat_fd);
+    close(state.processes[i].statm_fd);
+    close(state.processes[i].io_fd);
+    close(state.processes[i].children_fd);
+  }
+  free(state.processes);
+  return SUCCESS;
+}
+
+/*
+ * Function: run_jobs
+ * -----------------------------------------------------------------------------
+ * Takes the arguments of the jobs builtin and its context as parameters:
+ *   jobs [-d | --top [INTERVAL [COUNT]]]
+ * List the background processes and background builtins of the shell,
+ *   or show their resource usage with --top every INTERVAL seconds
+ *   (1 by default), COUNT times or until they have all finished.
+ * With -d, list the finished jobs last reported by a summary line.
+ * Runs in a forked child, on a snapshot of the background processes,
+ *   so --top can be interrupted with SIGINT.
+ */
+int run_jobs(char **arguments, struct builtin_context *context) {
+
+  int num_jobs = 0;
+  for (struct process *current = program_status.background; current;
+       current = current->next)
+    num_jobs++;
+
+  pid_t jobs[num_jobs + 1];
+  num_jobs = 0;
+  for (struct process *current = program_status.background; current;
+       current = current->next) {
+    if (!current->thread_job)
+      jobs[num_jobs++] = current->process_id;
+
+    // Only the default listing names the jobs
+    if (arguments[1])
+      continue;
+    if (current->thread_job)
+      printf("job %d running on the thread pool\n",
+             current->thread_job->job_id);
+    else
+      printf("pid %d running\n", (int)current->process_id);
+  }
+  fflush(stdout);
+
+  if (!arguments[1])
+    return SUCCESS;
+
+  // The finished jobs of the last summarized batch
+  if (strcmp(arguments[1], "-d") == 0) {
+    write_all(STDOUT_FILENO, done_notifications.data,
+              done_notifications.length);
+    return SUCCESS;
+  }
+
+  double interval = arguments[2] ? atof(arguments[2]) : 1;
+  int count = arguments[2] && arguments[3] ? atoi(arguments[3]) : 0;
+  if (strcmp(arguments[1], "--top") != 0 || interval <= 0 || count < 0) {
+    fprintf(stderr, "usage: jobs [-d | --top [INTERVAL [COUNT]]]\n");
+    return FAILURE;
+  }
+
+  return show_top(jobs, num_jobs, interval, count);
+}